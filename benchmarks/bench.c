@@ -1,5 +1,8 @@
 #include "binaryfusefilter.h"
+#include "binaryfusefilter_probe.h"
+#include "xorfilter.h"
 #include <assert.h>
+#include <chrono>
 #include <time.h>
 #include <numeric>
 
@@ -54,11 +57,158 @@ bool testbinaryfuse16(size_t size) {
   return true;
 }
 
+// Build from keys, then from their hashes, unordered and sorted, side by side.
+bool testbinaryfuse8_hashes(size_t size) {
+  printf("testing binary fuse8 built from keys and from hashes ");
+  printf("size = %zu \n", size);
+
+  std::vector<uint64_t> big_set(size);
+  std::iota(big_set.begin(), big_set.end(), 0);
+  uint64_t rng = 1234;
+  std::vector<uint64_t> hashes(size);
+  for (size_t i = 0; i < size; i++) {
+    hashes[i] = binary_fuse_rng_splitmix64(&rng);
+  }
+  std::vector<uint64_t> sorted(hashes);
+  std::sort(sorted.begin(), sorted.end());
+
+  binary_fuse8_t keyed(size);
+  binary_fuse8_hashed_t hashed(size);
+  const char *names[] = {"keys", "unordered hashes", "sorted hashes"};
+  std::vector<uint64_t> input;
+  for (int kind = 0; kind < 3; kind++) {
+    double best = 1e300;
+    for (size_t times = 0; times < 5; times++) {
+      input = (kind == 0) ? big_set : (kind == 1) ? hashes : sorted;
+      auto start = std::chrono::steady_clock::now();
+      bool ok = (kind == 0) ? keyed.populate(input) : hashed.populate(input);
+      if (!ok) { return false; }
+      best = std::min(best, std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+    }
+    printf("It took %f seconds to build an index over %zu %s. \n", best, size,
+           names[kind]);
+  }
+  return true;
+}
+
+// Build time, size and query time of a filter type, for comparisons.
+template <typename Filter>
+bool benchfilter(const char *name, size_t size) {
+  std::vector<uint64_t> big_set(size);
+  std::iota(big_set.begin(), big_set.end(), 0);
+  Filter filter(size);
+  double build = 1e300;
+  for (size_t times = 0; times < 3; times++) {
+    auto start = std::chrono::steady_clock::now();
+    if (!filter.populate(big_set)) { return false; }
+    build = std::min(build, std::chrono::duration<double>(
+                                std::chrono::steady_clock::now() - start)
+                                .count());
+  }
+  // half of the queried keys are in the set
+  uint64_t rng = 1234;
+  size_t queries = 10000000;
+  std::vector<uint64_t> keys(queries);
+  for (size_t i = 0; i < queries; i++) {
+    uint64_t r = binary_fuse_rng_splitmix64(&rng);
+    keys[i] = (r & 1) ? r % size : size + (r >> 2);
+  }
+  std::unique_ptr<bool[]> out(new bool[queries]);
+  auto start = std::chrono::steady_clock::now();
+  filter.contain_batch(keys.data(), queries, out.get());
+  double ns = std::chrono::duration<double, std::nano>(
+                  std::chrono::steady_clock::now() - start)
+                  .count();
+  size_t positives = std::count(out.get(), out.get() + queries, true);
+  printf("%-10s size = %9zu build %7.1f ns/key %6.2f bits/key query %6.2f "
+         "ns/key (%zu positives)\n",
+         name, size, build * 1e9 / size, filter.size_in_bytes() * 8.0 / size,
+         ns / queries, positives);
+  return true;
+}
+
+// Probe a column of 'rows' keys, a fraction 'selectivity' of which are in a
+// filter of 'size' keys.
+bool benchprobe(size_t size, size_t rows, double selectivity) {
+  printf("probing binary fuse8 size = %zu rows = %zu selectivity = %.1f%% \n",
+         size, rows, selectivity * 100);
+
+  binary_fuse8_t filter(size);
+  std::vector<uint64_t> big_set(size);
+  std::iota(big_set.begin(), big_set.end(), 0);
+  if (!filter.populate(big_set)) { return false; }
+
+  uint64_t rng = 1234;
+  std::vector<uint64_t> values(rows);
+  for (size_t i = 0; i < rows; i++) {
+    uint64_t r = binary_fuse_rng_splitmix64(&rng);
+    values[i] = ((double)(r >> 11) / (double)(UINT64_C(1) << 53) < selectivity)
+                    ? r % size
+                    : size + r % (UINT64_C(1) << 62);
+  }
+  binary_fuse_column_t column;
+  column.values = values.data();
+  column.length = rows;
+  std::vector<uint32_t> selection(rows);
+
+  // both are timed on the same clock, best of 5 runs
+  size_t count = 0;
+  double ns = 1e300;
+  for (size_t times = 0; times < 5; times++) {
+    auto start = std::chrono::steady_clock::now();
+    count = 0;
+    for (size_t i = 0; i < rows; i++) {
+      if (filter.contain(values[i])) {
+        selection[count++] = i;
+      }
+    }
+    ns = std::min(ns, std::chrono::duration<double, std::nano>(
+                          std::chrono::steady_clock::now() - start)
+                          .count());
+  }
+  printf("contain() and branch: %.2f ns/row (%zu selected) \n", ns / rows,
+         count);
+
+  std::vector<unsigned> threads = {1};
+  if (std::thread::hardware_concurrency() > 1) {
+    threads.push_back(std::thread::hardware_concurrency());
+  }
+  for (unsigned n : threads) {
+    ns = 1e300;
+    for (size_t times = 0; times < 5; times++) {
+      auto start = std::chrono::steady_clock::now();
+      count = binary_fuse_probe(filter, column, selection.data(), n);
+      ns = std::min(ns, std::chrono::duration<double, std::nano>(
+                            std::chrono::steady_clock::now() - start)
+                            .count());
+    }
+    printf("binary_fuse_probe, %u threads: %.2f ns/row (%zu selected) \n", n,
+           ns / rows, count);
+  }
+  return true;
+}
+
 int main() {
   for (size_t s = 10000000; s <= 10000000; s *= 10) {
     if (!testbinaryfuse8(s)) { abort(); }
     if (!testbinaryfuse16(s)) { abort(); }
+    if (!testbinaryfuse8_hashes(s)) { abort(); }
 
     printf("\n");
   }
+  for (size_t s : {100000, 1000000, 10000000}) {
+    if (!benchfilter<binary_fuse8_t>("fuse8", s)) { abort(); }
+    if (!benchfilter<xor_filter8_t>("xor8", s)) { abort(); }
+    if (!benchfilter<xor_plus_filter8_t>("xor+8", s)) { abort(); }
+    if (!benchfilter<binary_fuse16_t>("fuse16", s)) { abort(); }
+    if (!benchfilter<xor_filter16_t>("xor16", s)) { abort(); }
+    if (!benchfilter<xor_plus_filter16_t>("xor+16", s)) { abort(); }
+    printf("\n");
+  }
+  for (double selectivity : {0.001, 0.01, 0.1, 0.5, 0.9, 0.99}) {
+    if (!benchprobe(1000000, 10000000, selectivity)) { abort(); }
+    printf("\n");
+  }
 }
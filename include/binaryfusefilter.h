@@ -9,6 +9,7 @@
 #include <stddef.h>
 #include <stdexcept>
 #include <stdint.h>
+#include <string.h>
 
 #include <memory>
 #include <type_traits>
@@ -40,6 +41,16 @@ static inline uint32_t binary_fuse_reduce(uint32_t hash, uint32_t n) {
   // http://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
   return (uint32_t)(((uint64_t)hash * n) >> 32);
 }
+static inline void binary_fuse_prefetch(const void *address) {
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(address);
+#else
+  (void)address;
+#endif
+}
+
+// keys per block of contain_batch(), whose fingerprints are prefetched together
+#define BINARY_FUSE_BATCH_BLOCK 32
 
 /**
  * We need a decent random number generator.
@@ -165,6 +176,308 @@ static inline uint64_t binary_fuse_fingerprint(uint64_t hash) {
   return hash ^ (hash >> 32);
 }
 
+// position of the index-th (0, 1 or 2) fingerprint of a hash
+static inline uint32_t binary_fuse_position(int index, uint64_t hash,
+                                            uint32_t segmentCountLength,
+                                            uint32_t segmentLength,
+                                            uint32_t segmentLengthMask) {
+  uint64_t h = binary_fuse_mulhi(hash, segmentCountLength);
+  h += index * segmentLength;
+  // keep the lower 36 bits
+  uint64_t hh = hash & ((UINT64_C(1) << 36) - 1);
+  // index 0: right shift by 36; index 1: right shift by 18; index 2: no shift
+  h ^= (size_t)((hh >> (36 - 18 * index)) & segmentLengthMask);
+  return h;
+}
+
+// The shape of a filter, for code that builds it outside of populate()
+// (see binaryfusefilter_distributed.h).
+struct binary_fuse_layout_t {
+  uint32_t segmentLength;
+  uint32_t segmentLengthMask;
+  uint32_t segmentCount;
+  uint32_t segmentCountLength;
+  uint32_t arrayLength;
+
+  uint32_t position(int index, uint64_t hash) const {
+    return binary_fuse_position(index, hash, segmentCountLength,
+                                segmentLength, segmentLengthMask);
+  }
+
+  // the three positions of a hash, with a single multiplication
+  void positions(uint64_t hash, uint32_t h[3]) const {
+    h[0] = (uint32_t)binary_fuse_mulhi(hash, segmentCountLength);
+    h[1] = h[0] + segmentLength;
+    h[2] = h[1] + segmentLength;
+    h[1] ^= (uint32_t)(hash >> 18) & segmentLengthMask;
+    h[2] ^= (uint32_t)(hash)&segmentLengthMask;
+  }
+
+  // segment holding the first position of a hash
+  uint32_t segment(uint64_t hash) const {
+    return (uint32_t)binary_fuse_mulhi(hash, segmentCountLength) /
+           segmentLength;
+  }
+};
+
+// shape of a filter for 'size' keys, size should be at least 2
+static inline binary_fuse_layout_t binary_fuse_calculate_layout(uint32_t size) {
+  binary_fuse_layout_t l;
+  uint32_t arity = 3;
+  l.segmentLength = binary_fuse_calculate_segment_length(arity, size);
+  if (l.segmentLength > 262144) {
+    l.segmentLength = 262144;
+  }
+  l.segmentLengthMask = l.segmentLength - 1;
+  double sizeFactor = binary_fuse_calculate_size_factor(arity, size);
+  uint32_t capacity = (uint32_t)(round((double)size * sizeFactor));
+  uint32_t initSegmentCount =
+      (capacity + l.segmentLength - 1) / l.segmentLength - (arity - 1);
+  l.arrayLength = (initSegmentCount + arity - 1) * l.segmentLength;
+  l.segmentCount = (l.arrayLength + l.segmentLength - 1) / l.segmentLength;
+  if (l.segmentCount <= arity - 1) {
+    l.segmentCount = 1;
+  } else {
+    l.segmentCount = l.segmentCount - (arity - 1);
+  }
+  l.arrayLength = (l.segmentCount + arity - 1) * l.segmentLength;
+  l.segmentCountLength = l.segmentCount * l.segmentLength;
+  return l;
+}
+
+// number of high bits of the hashes by which populate() groups them, enough
+// to tell the segments apart
+static inline uint32_t binary_fuse_block_bits(uint32_t segmentCount) {
+  uint32_t blockBits = 1;
+  while (((uint32_t)1 << blockBits) < segmentCount) {
+    blockBits += 1;
+  }
+  return blockBits;
+}
+
+// The hash used in place of 'hash' under another seed, for filters built from
+// hashes; seed 0 leaves it unchanged. The top 16 bits, which pick the segment
+// (at most 2^15 of them), are kept, so hashes grouped by segment stay grouped.
+// The lower 48 bits go through a bijective mixer: they pick the second and
+// third positions (h1, h2) within their segments and most of the
+// fingerprint. The first position, mulhi(hash, segmentCountLength), depends
+// mostly on the kept bits: it only moves within segmentCountLength / 2^16
+// slots, so below about 2^16 slots it stays the same (give or take one)
+// across retries.
+static inline uint64_t binary_fuse_remix(uint64_t hash, uint64_t seed) {
+  if (seed == 0) {
+    return hash;
+  }
+  const uint64_t mask = (UINT64_C(1) << 48) - 1;
+  uint64_t x = (hash + seed) & mask;
+  x ^= x >> 24;
+  x = (x * UINT64_C(0xff51afd7ed558ccd)) & mask;
+  x ^= x >> 24;
+  x = (x * UINT64_C(0xc4ceb9fe1a85ec53)) & mask;
+  x ^= x >> 24;
+  return (hash & ~mask) | x;
+}
+
+// Write hash(0), ..., hash(size - 1) to reverseOrder, which is zeroed, in a
+// single scatter that roughly groups them by their top blockBits bits, i.e.,
+// by segment, for locality: a full bucket spills over into the next ones.
+template <typename Hash>
+static inline void binary_fuse_scatter(uint64_t *reverseOrder, uint32_t size,
+                                       uint32_t blockBits, Hash hash) {
+  uint32_t block = ((uint32_t)1 << blockBits);
+  std::vector<uint32_t> startPos(block);
+  for (uint32_t i = 0; i < block; i++) {
+    // important : i * size would overflow as a 32-bit number in some
+    // cases.
+    startPos[i] = ((uint64_t)i * size) >> blockBits;
+  }
+
+  uint64_t maskblock = block - 1;
+  for (uint32_t i = 0; i < size; i++) {
+    uint64_t h = hash(i);
+    uint64_t segment_index = h >> (64 - blockBits);
+    while (reverseOrder[startPos[segment_index]] != 0) {
+      segment_index++;
+      segment_index &= maskblock;
+    }
+    reverseOrder[startPos[segment_index]] = h;
+    startPos[segment_index]++;
+  }
+}
+
+// The peeling engine of the filters with three positions per key
+// (binary_fuse_t, and the xor filters of xorfilter.h). layout.arrayLength is
+// the number of sets and layout.positions(hash, h) gives the three sets of a
+// hash.
+// fill(seed, size, reverseOrder) writes the hashes of the 'size' keys under
+// 'seed' to reverseOrder, which is zeroed and has a non-zero sentinel at
+// reverseOrder[size]; dedupe() removes the duplicated keys and returns their
+// number, it is called at most once, after a failed attempt. The first
+// attempt uses 'seed', the next ones draw it from rng_counter.
+// On success, reverseOrder[0, size) holds the hashes in peeling order and
+// reverseH[0, size) the index of the position that released each of them,
+// size and seed being updated. Fails after XOR_MAX_ITERATIONS attempts.
+template <typename Layout, typename Fill, typename Dedupe>
+static inline bool binary_fuse_peel(const Layout &layout, uint32_t &size,
+                                    uint64_t &seed, uint64_t rng_counter,
+                                    Fill fill, Dedupe dedupe,
+                                    std::vector<uint64_t> &reverseOrder,
+                                    std::vector<uint8_t> &reverseH) {
+  reverseOrder.assign(size + 1, 0);
+  reverseH.assign(size, 0);
+  uint32_t capacity = layout.arrayLength;
+
+  std::vector<uint32_t> alone(capacity);
+  std::vector<uint8_t> t2count(capacity);
+  std::vector<uint64_t> t2hash(capacity);
+
+  uint32_t h012[3];
+  bool deduped = false;
+
+  reverseOrder[size] = 1;
+  for (int loop = 0; true; ++loop) {
+    if (loop + 1 > XOR_MAX_ITERATIONS) {
+      // The probability of this happening is lower than the
+      // the cosmic-ray probability (i.e., a cosmic ray corrupts your system).
+      return false;
+    }
+
+    fill(seed, size, reverseOrder.data());
+    int error = 0;
+    uint32_t duplicates = 0;
+    for (uint32_t i = 0; i < size; i++) {
+      uint64_t hash = reverseOrder[i];
+      layout.positions(hash, h012);
+      uint32_t h0 = h012[0];
+      uint32_t h1 = h012[1];
+      uint32_t h2 = h012[2];
+      t2count[h0] += 4;
+      t2hash[h0] ^= hash;
+      t2count[h1] += 4;
+      t2count[h1] ^= 1;
+      t2hash[h1] ^= hash;
+      t2count[h2] += 4;
+      t2hash[h2] ^= hash;
+      t2count[h2] ^= 2;
+      if ((t2hash[h0] & t2hash[h1] & t2hash[h2]) == 0) {
+        if (((t2hash[h0] == 0) && (t2count[h0] == 8)) ||
+            ((t2hash[h1] == 0) && (t2count[h1] == 8)) ||
+            ((t2hash[h2] == 0) && (t2count[h2] == 8))) {
+          duplicates += 1;
+          t2count[h0] -= 4;
+          t2hash[h0] ^= hash;
+          t2count[h1] -= 4;
+          t2count[h1] ^= 1;
+          t2hash[h1] ^= hash;
+          t2count[h2] -= 4;
+          t2count[h2] ^= 2;
+          t2hash[h2] ^= hash;
+        }
+      }
+      error = (t2count[h0] < 4) ? 1 : error;
+      error = (t2count[h1] < 4) ? 1 : error;
+      error = (t2count[h2] < 4) ? 1 : error;
+    }
+    // End of key addition
+    uint32_t stacksize = 0;
+    if (!error) {
+      // The keys are peeled in rounds: every set holding a single key at the
+      // start of a round releases it, and a key alone in several sets is
+      // released by the one with the lowest index. The outcome does not
+      // depend on the order in which the sets are visited, which lets a build
+      // split by segment range (binaryfusefilter_distributed.h) reproduce it.
+      uint32_t Qsize = 0;
+      // Add sets with one key to the queue.
+      for (uint32_t i = 0; i < capacity; i++) {
+        alone[Qsize] = i;
+        Qsize += ((t2count[i] >> 2) == 1) ? 1 : 0;
+      }
+      while (Qsize > 0) {
+        uint32_t roundStart = stacksize;
+        for (uint32_t q = 0; q < Qsize; q++) {
+          uint32_t index = alone[q];
+          if ((t2count[index] >> 2) != 1) {
+            continue;
+          }
+          uint64_t hash = t2hash[index];
+          uint8_t found = t2count[index] & 3;
+          bool lower = false;
+          if (found > 0) {
+            layout.positions(hash, h012);
+            lower = ((t2count[h012[0]] >> 2) == 1) ||
+                    ((found > 1) && ((t2count[h012[1]] >> 2) == 1));
+          }
+          if (!lower) {
+            reverseH[stacksize] = found;
+            reverseOrder[stacksize] = hash;
+            stacksize++;
+          }
+        }
+        // Remove the keys released in this round, queueing the sets that
+        // are left with one key.
+        Qsize = 0;
+        for (uint32_t i = roundStart; i < stacksize; i++) {
+          uint64_t hash = reverseOrder[i];
+          layout.positions(hash, h012);
+          for (uint8_t j = 0; j < 3; j++) {
+            uint32_t index = h012[j];
+            t2count[index] -= 4;
+            t2count[index] ^= j;
+            t2hash[index] ^= hash;
+            alone[Qsize] = index;
+            Qsize += ((t2count[index] >> 2) == 1) ? 1 : 0;
+          }
+        }
+      }
+    }
+    if (!error && stacksize + duplicates == size) {
+      // success
+      size = stacksize;
+      return true;
+    }
+
+    // The attempt failed. Duplicated keys, which have the same hash under
+    // every seed, are not always caught during the addition and then make the
+    // peeling fail: they are removed and the same seed is tried again. The
+    // outcome is thus that of the distinct hashes, whatever their order
+    // (binaryfusefilter_distributed.h relies on it).
+    uint32_t distinct = deduped ? size : dedupe();
+    deduped = true;
+    bool sameSeed = distinct < size;
+    size = distinct;
+    std::fill(reverseOrder.begin(), reverseOrder.end(), 0);
+    reverseOrder[size] = 1;
+    std::fill(t2count.begin(), t2count.end(), 0);
+    std::fill(t2hash.begin(), t2hash.end(), 0);
+    if (sameSeed) {
+      --loop; // not a new attempt
+    } else {
+      // TOOD: Actual random
+      seed = binary_fuse_rng_splitmix64(&rng_counter);
+    }
+  }
+}
+
+// Set the fingerprints once all the keys have been peeled, by walking
+// binary_fuse_peel()'s output backward. The fingerprints must be zero.
+template <typename Layout, typename T>
+static inline void binary_fuse_assign(const Layout &layout, T *fingerprints,
+                                      const uint64_t *hashes,
+                                      const uint8_t *found, uint32_t size) {
+  uint32_t h012[5];
+  for (uint32_t i = size - 1; i < size; i--) {
+    // the hash of the key we insert next
+    uint64_t hash = hashes[i];
+    T xor2 = binary_fuse_fingerprint(hash);
+    uint8_t index = found[i];
+    layout.positions(hash, h012);
+    h012[3] = h012[0];
+    h012[4] = h012[1];
+    fingerprints[h012[index]] = xor2 ^ fingerprints[h012[index + 1]] ^
+                                fingerprints[h012[index + 2]];
+  }
+}
+
 template <typename T,
           class = typename std::enable_if_t<std::is_unsigned<T>::value>>
 class binary_fuse_t {
@@ -194,17 +507,49 @@ private:
     return ans;
   }
 
-  uint32_t binary_fuse_hash(int index, uint64_t hash) const {
-    uint64_t h = binary_fuse_mulhi(hash, _segmentCountLength);
-    h += index * _segmentLength;
-    // keep the lower 36 bits
-    uint64_t hh = hash & ((1UL << 36) - 1);
-    // index 0: right shift by 36; index 1: right shift by 18; index 2: no shift
-    h ^= (size_t)((hh >> (36 - 18 * index)) & _segmentLengthMask);
-    return h;
+protected:
+  bool contain_mixed(uint64_t hash) const {
+    T f = binary_fuse_fingerprint(hash);
+    binary_hashes_t hashes = hash_batch(hash);
+    f ^= _fingerprints[hashes.h0] ^ _fingerprints[hashes.h1] ^
+         _fingerprints[hashes.h2];
+    return f == 0;
   }
 
+  // emit(i, contain_mixed(mix(keys[i]))) for i in [0, n), in order. The
+  // positions of a block of keys are all computed and prefetched before the
+  // fingerprints are read, so that their cache misses overlap.
+  template <typename Mix, typename Emit>
+  void contain_mixed_batch(const uint64_t *keys, size_t n, Mix mix,
+                           Emit emit) const {
+    uint64_t hashes[BINARY_FUSE_BATCH_BLOCK];
+    binary_hashes_t positions[BINARY_FUSE_BATCH_BLOCK];
+    const T *fingerprints = _fingerprints.data();
+    for (size_t start = 0; start < n; start += BINARY_FUSE_BATCH_BLOCK) {
+      size_t m = std::min<size_t>(BINARY_FUSE_BATCH_BLOCK, n - start);
+      for (size_t i = 0; i < m; i++) {
+        hashes[i] = mix(keys[start + i]);
+        positions[i] = hash_batch(hashes[i]);
+        binary_fuse_prefetch(fingerprints + positions[i].h0);
+        binary_fuse_prefetch(fingerprints + positions[i].h1);
+        binary_fuse_prefetch(fingerprints + positions[i].h2);
+      }
+      for (size_t i = 0; i < m; i++) {
+        T f = binary_fuse_fingerprint(hashes[i]);
+        f ^= fingerprints[positions[i].h0] ^ fingerprints[positions[i].h1] ^
+             fingerprints[positions[i].h2];
+        emit(start + i, f == 0);
+      }
+    }
+  }
+
+
 public:
+  typedef T fingerprint_t;
+
+  // initial state of the generator of the seeds tried by populate()
+  static constexpr uint64_t default_rng_seed = 0x726b2b9d438b9d4d;
+
   // allocate enough capacity for a set containing up to 'size' elements
   // size should be at least 2.
   explicit binary_fuse_t(uint32_t size) {
@@ -212,36 +557,57 @@ public:
       throw std::runtime_error("size should be at least 2");
     }
 
-    uint32_t arity = 3;
-    _segmentLength = binary_fuse_calculate_segment_length(arity, size);
-    if (_segmentLength > 262144) {
-      _segmentLength = 262144;
-    }
-    _segmentLengthMask = _segmentLength - 1;
-    double sizeFactor = binary_fuse_calculate_size_factor(arity, size);
-    uint32_t capacity = (uint32_t)(round((double)size * sizeFactor));
-    uint32_t initSegmentCount =
-        (capacity + _segmentLength - 1) / _segmentLength - (arity - 1);
-    _arrayLength = (initSegmentCount + arity - 1) * _segmentLength;
-    _segmentCount = (_arrayLength + _segmentLength - 1) / _segmentLength;
-    if (_segmentCount <= arity - 1) {
-      _segmentCount = 1;
-    } else {
-      _segmentCount = _segmentCount - (arity - 1);
-    }
-    _arrayLength = (_segmentCount + arity - 1) * _segmentLength;
-    _segmentCountLength = _segmentCount * _segmentLength;
+    binary_fuse_layout_t l = binary_fuse_calculate_layout(size);
+    _segmentLength = l.segmentLength;
+    _segmentLengthMask = l.segmentLengthMask;
+    _segmentCount = l.segmentCount;
+    _segmentCountLength = l.segmentCountLength;
+    _arrayLength = l.arrayLength;
     _fingerprints.resize(_arrayLength);
   }
 
   // Report if the key is in the set, with false positive rate.
   bool contain(uint64_t key) const {
-    uint64_t hash = binary_fuse_mix_split(key, _seed);
-    T f = binary_fuse_fingerprint(hash);
-    binary_hashes_t hashes = hash_batch(hash);
-    f ^= _fingerprints[hashes.h0] ^ _fingerprints[hashes.h1] ^
-         _fingerprints[hashes.h2];
-    return f == 0;
+    return contain_mixed(binary_fuse_mix_split(key, _seed));
+  }
+
+  // out[i] = contain(keys[i]) for i in [0, n)
+  void contain_batch(const uint64_t *keys, size_t n, bool *out) const {
+    uint64_t seed = _seed;
+    contain_mixed_batch(
+        keys, n, [seed](uint64_t key) { return binary_fuse_mix_split(key, seed); },
+        [out](size_t i, bool answer) { out[i] = answer; });
+  }
+
+  // Write to selection the indexes first + i of the keys[i] that may be in
+  // the set, in increasing order, and return their number: contain_batch()
+  // and its compaction in a single pass. selection must have room for n
+  // entries.
+  size_t select_batch(const uint64_t *keys, size_t n, uint32_t first,
+                      uint32_t *selection) const {
+    uint64_t seed = _seed;
+    size_t count = 0;
+    contain_mixed_batch(
+        keys, n, [seed](uint64_t key) { return binary_fuse_mix_split(key, seed); },
+        [&count, first, selection](size_t i, bool answer) {
+          selection[count] = first + (uint32_t)i;
+          count += answer;
+        });
+    return count;
+  }
+
+  uint64_t seed() const { return _seed; }
+
+  const std::vector<T> &fingerprints() const { return _fingerprints; }
+
+  binary_fuse_layout_t layout() const {
+    binary_fuse_layout_t l;
+    l.segmentLength = _segmentLength;
+    l.segmentLengthMask = _segmentLengthMask;
+    l.segmentCount = _segmentCount;
+    l.segmentCountLength = _segmentCountLength;
+    l.arrayLength = _arrayLength;
+    return l;
   }
 
   // report memory usage
@@ -249,180 +615,119 @@ public:
     return _arrayLength * sizeof(T) + sizeof(*this);
   }
 
+  // number of bytes needed by serialize(): the header fields followed by the
+  // fingerprints, in the same order as the C library's binary_fuse8_t.
+  size_t serialization_bytes() const {
+    return serialization_header_bytes() + _arrayLength * sizeof(T);
+  }
+
+  static constexpr size_t serialization_header_bytes() {
+    return sizeof(uint64_t) + 5 * sizeof(uint32_t);
+  }
+
+  // write the filter to buffer, which must hold serialization_bytes() bytes.
+  // The serialization does not handle endianess.
+  void serialize(char *buffer) const {
+    memcpy(buffer, &_seed, sizeof(_seed));
+    buffer += sizeof(_seed);
+    memcpy(buffer, &_segmentLength, sizeof(_segmentLength));
+    buffer += sizeof(_segmentLength);
+    memcpy(buffer, &_segmentLengthMask, sizeof(_segmentLengthMask));
+    buffer += sizeof(_segmentLengthMask);
+    memcpy(buffer, &_segmentCount, sizeof(_segmentCount));
+    buffer += sizeof(_segmentCount);
+    memcpy(buffer, &_segmentCountLength, sizeof(_segmentCountLength));
+    buffer += sizeof(_segmentCountLength);
+    memcpy(buffer, &_arrayLength, sizeof(_arrayLength));
+    buffer += sizeof(_arrayLength);
+    memcpy(buffer, _fingerprints.data(), _arrayLength * sizeof(T));
+  }
+
+  // replace the content of the filter by the one serialized in buffer.
+  void deserialize(const char *buffer) {
+    memcpy(&_seed, buffer, sizeof(_seed));
+    buffer += sizeof(_seed);
+    memcpy(&_segmentLength, buffer, sizeof(_segmentLength));
+    buffer += sizeof(_segmentLength);
+    memcpy(&_segmentLengthMask, buffer, sizeof(_segmentLengthMask));
+    buffer += sizeof(_segmentLengthMask);
+    memcpy(&_segmentCount, buffer, sizeof(_segmentCount));
+    buffer += sizeof(_segmentCount);
+    memcpy(&_segmentCountLength, buffer, sizeof(_segmentCountLength));
+    buffer += sizeof(_segmentCountLength);
+    memcpy(&_arrayLength, buffer, sizeof(_arrayLength));
+    buffer += sizeof(_arrayLength);
+    _fingerprints.resize(_arrayLength);
+    memcpy(_fingerprints.data(), buffer, _arrayLength * sizeof(T));
+  }
+
   // Construct the filter, returns true on success, false on failure.
   // The algorithm fails when there is insufficient memory.
   // For best performance, the caller should ensure that there are not
   // too many duplicated keys.
   // While highly improbable, it is possible that the population fails, at which
   // point the seed must be rotated.
-  // keys will be sorted and duplicates removed if any duplicate keys exist
-  [[nodiscard]] bool populate(std::vector<uint64_t> &keys) {
+  // keys may be sorted, and duplicates are removed if any duplicate keys exist
+  // The seeds are drawn from a generator started at rng_seed: a given set of
+  // keys and rng_seed always produce the same filter.
+  [[nodiscard]] bool populate(std::vector<uint64_t> &keys,
+                              uint64_t rng_seed = default_rng_seed) {
     if (keys.size() > std::numeric_limits<uint32_t>::max()) {
       throw std::runtime_error("size should be at most 2^32");
     }
 
-    uint32_t size = keys.size();
-
-    uint64_t rng_counter = 0x726b2b9d438b9d4d;
-    _seed = binary_fuse_rng_splitmix64(&rng_counter);
-
-    std::vector<uint64_t> reverseOrder(size + 1);
-    uint32_t capacity = _arrayLength;
-
-    std::vector<uint32_t> alone(capacity);
-    std::vector<uint8_t> t2count(capacity);
-    std::vector<uint8_t> reverseH(size);
-    std::vector<uint64_t> t2hash(capacity);
+    uint32_t blockBits = binary_fuse_block_bits(_segmentCount);
+
+    uint64_t rng_counter = rng_seed;
+    uint64_t seed = binary_fuse_rng_splitmix64(&rng_counter);
+    auto fill = [&](uint64_t attemptSeed, uint32_t size,
+                    uint64_t *reverseOrder) {
+      binary_fuse_scatter(reverseOrder, size, blockBits, [&](uint32_t i) {
+        return binary_fuse_murmur64(keys[i] + attemptSeed);
+      });
+    };
+    auto dedupe = [&]() {
+      // Sort keys and remove duplicates
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      return (uint32_t)keys.size();
+    };
+    return build((uint32_t)keys.size(), seed, rng_counter, fill, dedupe);
+  }
 
-    uint32_t blockBits = 1;
-    while (((uint32_t)1 << blockBits) < _segmentCount) {
-      blockBits += 1;
+protected:
+  // The construction shared by populate() and binary_fuse_hashed_t, see
+  // binary_fuse_peel().
+  template <typename Fill, typename Dedupe>
+  bool build(uint32_t size, uint64_t seed, uint64_t rng_counter, Fill fill,
+             Dedupe dedupe) {
+    std::vector<uint64_t> reverseOrder;
+    std::vector<uint8_t> reverseH;
+    if (!binary_fuse_peel(layout(), size, seed, rng_counter, fill, dedupe,
+                          reverseOrder, reverseH)) {
+      return false;
     }
-    uint32_t block = ((uint32_t)1 << blockBits);
-
-    std::vector<uint32_t> startPos(1 << blockBits);
-    uint32_t h012[5];
-
-    reverseOrder[size] = 1;
-    for (int loop = 0; true; ++loop) {
-      if (loop + 1 > XOR_MAX_ITERATIONS) {
-        // The probability of this happening is lower than the
-        // the cosmic-ray probability (i.e., a cosmic ray corrupts your system).
-        return false;
-      }
-
-      for (uint32_t i = 0; i < block; i++) {
-        // important : i * size would overflow as a 32-bit number in some
-        // cases.
-        startPos[i] = ((uint64_t)i * size) >> blockBits;
-      }
-
-      uint64_t maskblock = block - 1;
-      for (uint32_t i = 0; i < size; i++) {
-        uint64_t hash = binary_fuse_murmur64(keys[i] + _seed);
-        uint64_t segment_index = hash >> (64 - blockBits);
-        while (reverseOrder[startPos[segment_index]] != 0) {
-          segment_index++;
-          segment_index &= maskblock;
-        }
-        reverseOrder[startPos[segment_index]] = hash;
-        startPos[segment_index]++;
-      }
-      int error = 0;
-      uint32_t duplicates = 0;
-      for (uint32_t i = 0; i < size; i++) {
-        uint64_t hash = reverseOrder[i];
-        uint32_t h0 = binary_fuse_hash(0, hash);
-        t2count[h0] += 4;
-        t2hash[h0] ^= hash;
-        uint32_t h1 = binary_fuse_hash(1, hash);
-        t2count[h1] += 4;
-        t2count[h1] ^= 1;
-        t2hash[h1] ^= hash;
-        uint32_t h2 = binary_fuse_hash(2, hash);
-        t2count[h2] += 4;
-        t2hash[h2] ^= hash;
-        t2count[h2] ^= 2;
-        if ((t2hash[h0] & t2hash[h1] & t2hash[h2]) == 0) {
-          if (((t2hash[h0] == 0) && (t2count[h0] == 8)) ||
-              ((t2hash[h1] == 0) && (t2count[h1] == 8)) ||
-              ((t2hash[h2] == 0) && (t2count[h2] == 8))) {
-            duplicates += 1;
-            t2count[h0] -= 4;
-            t2hash[h0] ^= hash;
-            t2count[h1] -= 4;
-            t2count[h1] ^= 1;
-            t2hash[h1] ^= hash;
-            t2count[h2] -= 4;
-            t2count[h2] ^= 2;
-            t2hash[h2] ^= hash;
-          }
-        }
-        error = (t2count[h0] < 4) ? 1 : error;
-        error = (t2count[h1] < 4) ? 1 : error;
-        error = (t2count[h2] < 4) ? 1 : error;
-      }
-      if (error) {
-        std::fill(reverseOrder.begin(), reverseOrder.end(), 0);
-        std::fill(t2count.begin(), t2count.end(), 0);
-        std::fill(t2hash.begin(), t2hash.end(), 0);
-
-        // TOOD: Actual random
-        _seed = binary_fuse_rng_splitmix64(&rng_counter);
-        continue;
-      }
-
-      // End of key addition
-      uint32_t Qsize = 0;
-      // Add sets with one key to the queue.
-      for (uint32_t i = 0; i < capacity; i++) {
-        alone[Qsize] = i;
-        Qsize += ((t2count[i] >> 2) == 1) ? 1 : 0;
-      }
-      uint32_t stacksize = 0;
-      while (Qsize > 0) {
-        Qsize--;
-        uint32_t index = alone[Qsize];
-        if ((t2count[index] >> 2) == 1) {
-          uint64_t hash = t2hash[index];
-
-          // h012[0] = binary_fuse16_hash(0, hash);
-          h012[1] = binary_fuse_hash(1, hash);
-          h012[2] = binary_fuse_hash(2, hash);
-          h012[3] = binary_fuse_hash(0, hash); // == h012[0];
-          h012[4] = h012[1];
-          uint8_t found = t2count[index] & 3;
-          reverseH[stacksize] = found;
-          reverseOrder[stacksize] = hash;
-          stacksize++;
-          uint32_t other_index1 = h012[found + 1];
-          alone[Qsize] = other_index1;
-          Qsize += ((t2count[other_index1] >> 2) == 2 ? 1 : 0);
-
-          t2count[other_index1] -= 4;
-          t2count[other_index1] ^= binary_fuse_mod3(found + 1);
-          t2hash[other_index1] ^= hash;
-
-          uint32_t other_index2 = h012[found + 2];
-          alone[Qsize] = other_index2;
-          Qsize += ((t2count[other_index2] >> 2) == 2 ? 1 : 0);
-          t2count[other_index2] -= 4;
-          t2count[other_index2] ^= binary_fuse_mod3(found + 2);
-          t2hash[other_index2] ^= hash;
-        }
-      }
-      if (stacksize + duplicates == size) {
-        // success
-        size = stacksize;
-        break;
-      } else if (duplicates > 0) {
-        // Sort keys and remove duplicates
-        std::sort(keys.begin(), keys.end());
-        keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
-        size = keys.size();
-      }
+    assign(seed, reverseOrder.data(), reverseH.data(), size);
+    return true;
+  }
 
-      // Reset everything except for the last entry in reverseOrder
-      std::fill_n(reverseOrder.begin(), size, 0);
-      std::fill(t2count.begin(), t2count.end(), 0);
-      std::fill(t2hash.begin(), t2hash.end(), 0);
-      _seed = binary_fuse_rng_splitmix64(&rng_counter);
-    }
+public:
+  // Set the fingerprints once all the keys have been peeled: hashes[i] is the
+  // hash under 'seed' of the i-th key peeled and found[i] the index (0, 1 or
+  // 2) of the position that released it. Keys released in the same round may
+  // come in any order.
+  void assign(uint64_t seed, const uint64_t *hashes, const uint8_t *found,
+              uint32_t size) {
+    _seed = seed;
+    std::fill(_fingerprints.begin(), _fingerprints.end(), 0);
+    binary_fuse_assign(layout(), _fingerprints.data(), hashes, found, size);
+  }
 
-    for (uint32_t i = size - 1; i < size; i--) {
-      // the hash of the key we insert next
-      uint64_t hash = reverseOrder[i];
-      T xor2 = binary_fuse_fingerprint(hash);
-      uint8_t found = reverseH[i];
-      h012[0] = binary_fuse_hash(0, hash);
-      h012[1] = binary_fuse_hash(1, hash);
-      h012[2] = binary_fuse_hash(2, hash);
-      h012[3] = h012[0];
-      h012[4] = h012[1];
-      _fingerprints[h012[found]] = xor2 ^ _fingerprints[h012[found + 1]] ^
-                                   _fingerprints[h012[found + 2]];
-    }
-    return true;
+  // Continue assign() with keys peeled before all those given so far, when
+  // the peeling order is split over several arrays: the last rounds first.
+  void assign_earlier(const uint64_t *hashes, const uint8_t *found,
+                      uint32_t size) {
+    binary_fuse_assign(layout(), _fingerprints.data(), hashes, found, size);
   }
 };
 
@@ -438,4 +743,94 @@ typedef binary_fuse_t<uint16_t> binary_fuse16_t;
 // Approximate bits per entry: 36
 typedef binary_fuse_t<uint32_t> binary_fuse32_t;
 
+//////////////////
+// hashed fuseT
+//////////////////
+
+// A binary fuse filter of hashes that are already well mixed, e.g., the
+// output of a good 64-bit hash function: contain() and contain_batch() take
+// the hashes, not the keys. It is a distinct type so that it cannot be
+// queried with keys by mistake, and it fits wherever a filter of the queried
+// values does (binary_fuse_probe() over a column of hashes...).
+template <typename T,
+          class = typename std::enable_if_t<std::is_unsigned<T>::value>>
+class binary_fuse_hashed_t : private binary_fuse_t<T> {
+private:
+  typedef binary_fuse_t<T> base_t;
+
+public:
+  typedef T fingerprint_t;
+
+  using base_t::default_rng_seed;
+  using base_t::fingerprints;
+  using base_t::layout;
+  using base_t::seed;
+  using base_t::size_in_bytes;
+
+  // allocate enough capacity for a set containing up to 'size' elements
+  // size should be at least 2.
+  explicit binary_fuse_hashed_t(uint32_t size) : base_t(size) {}
+
+  // Report if the hash is in the set, with false positive rate.
+  bool contain(uint64_t hash) const {
+    return this->contain_mixed(binary_fuse_remix(hash, seed()));
+  }
+
+  // out[i] = contain(hashes[i]) for i in [0, n)
+  void contain_batch(const uint64_t *hashes, size_t n, bool *out) const {
+    uint64_t attemptSeed = seed();
+    this->contain_mixed_batch(
+        hashes, n,
+        [attemptSeed](uint64_t hash) {
+          return binary_fuse_remix(hash, attemptSeed);
+        },
+        [out](size_t i, bool answer) { out[i] = answer; });
+  }
+
+  // Construct the filter, returns true on success, false on failure. The
+  // hashes are used as they are by the first attempt, and remixed with
+  // binary_fuse_remix() by the next ones, which keeps their segment.
+  // Unless they are already grouped by segment (sorted hashes are), they go
+  // through the same single scatter as the hashes of populate(). They are
+  // sorted with duplicates removed if an attempt fails.
+  [[nodiscard]] bool populate(std::vector<uint64_t> &hashes,
+                              uint64_t rng_seed = default_rng_seed) {
+    if (hashes.size() > std::numeric_limits<uint32_t>::max()) {
+      throw std::runtime_error("size should be at most 2^32");
+    }
+
+    uint32_t blockBits = binary_fuse_block_bits(layout().segmentCount);
+    size_t n = hashes.size();
+    bool grouped = true;
+    for (size_t i = 1; i < n; i++) {
+      grouped &= (hashes[i - 1] >> (64 - blockBits)) <=
+                 (hashes[i] >> (64 - blockBits));
+    }
+
+    auto fill = [&](uint64_t attemptSeed, uint32_t size,
+                    uint64_t *reverseOrder) {
+      if (grouped) {
+        for (uint32_t i = 0; i < size; i++) {
+          reverseOrder[i] = binary_fuse_remix(hashes[i], attemptSeed);
+        }
+        return;
+      }
+      binary_fuse_scatter(reverseOrder, size, blockBits, [&](uint32_t i) {
+        return binary_fuse_remix(hashes[i], attemptSeed);
+      });
+    };
+    auto dedupe = [&]() {
+      std::sort(hashes.begin(), hashes.end());
+      hashes.erase(std::unique(hashes.begin(), hashes.end()), hashes.end());
+      grouped = true;
+      return (uint32_t)hashes.size();
+    };
+    return this->build((uint32_t)n, 0, rng_seed, fill, dedupe);
+  }
+};
+
+typedef binary_fuse_hashed_t<uint8_t> binary_fuse8_hashed_t;
+typedef binary_fuse_hashed_t<uint16_t> binary_fuse16_hashed_t;
+typedef binary_fuse_hashed_t<uint32_t> binary_fuse32_hashed_t;
+
 #endif
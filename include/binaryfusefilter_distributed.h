@@ -0,0 +1,642 @@
+#ifndef BINARYFUSEFILTER_DISTRIBUTED_H
+#define BINARYFUSEFILTER_DISTRIBUTED_H
+#include "binaryfusefilter.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+ * Construction of a binary fuse filter split by segment range, so that no
+ * process needs the temporary memory of populate() for the whole set.
+ *
+ * The three positions of a hash lie in three consecutive segments. Each
+ * worker owns a range of at least two segments, and the build goes:
+ *  1. every worker hashes its share of the keys and routes each hash to the
+ *     worker owning the segment of its first position; the hashes spilling
+ *     over the end of a range are also handed to the next worker;
+ *  2. every worker counts and peels the positions of its range, in the same
+ *     rounds as binary_fuse_t::populate(). Between rounds, neighbors exchange
+ *     the sets holding a single key near their boundary, and the keys they
+ *     released that also live on the other side;
+ *  3. the released hashes are collected and assigned to the fingerprints,
+ *     the rounds being walked backward over the output of each worker, so
+ *     that the coordinator holds no copy of them.
+ * The result is bit-identical to populate() on the same keys and rng_seed,
+ * duplicated keys included: the workers remove duplicated hashes before
+ * peeling, and populate() retries the same seed without its duplicates
+ * whenever an attempt fails.
+ *
+ * binary_fuse_segment_worker_t is one worker, independent of the transport.
+ * binary_fuse_multiprocess_populate() runs the protocol over local processes
+ * connected by pipes.
+ ***/
+
+//////////////////
+// segment worker
+//////////////////
+
+class binary_fuse_segment_worker_t {
+private:
+  binary_fuse_layout_t _layout;
+  uint32_t _begin; // first owned position
+  uint32_t _end;   // past the last owned position
+  std::vector<uint64_t> _hashes;   // hashes routed to this worker
+  std::vector<uint64_t> _boundary; // hashes of the previous worker reaching us
+  std::vector<uint8_t> _count;
+  std::vector<uint64_t> _xor;
+  std::vector<uint32_t> _frontier; // owned sets holding a single key
+  std::vector<uint64_t> _peeled;
+  std::vector<uint8_t> _found;
+  std::vector<uint32_t> _roundEnds;
+  size_t _roundStart;
+
+  void remove(uint64_t hash, bool queue) {
+    for (int j = 0; j < 3; j++) {
+      uint32_t p = _layout.position(j, hash);
+      if (p >= _begin && p < _end) {
+        p -= _begin;
+        _count[p]--;
+        _xor[p] ^= hash;
+        if (queue && _count[p] == 1) {
+          _frontier.push_back(p + _begin);
+        }
+      }
+    }
+  }
+
+public:
+  // first segment (as given by binary_fuse_layout_t::segment) of a worker
+  static uint32_t segment_begin(const binary_fuse_layout_t &layout,
+                                uint32_t worker, uint32_t workers) {
+    return (uint32_t)((uint64_t)layout.segmentCount * worker / workers);
+  }
+
+  // worker owning a segment
+  static uint32_t owner(const binary_fuse_layout_t &layout, uint32_t segment,
+                        uint32_t workers) {
+    return (uint32_t)(((uint64_t)(segment + 1) * workers +
+                       layout.segmentCount - 1) /
+                          layout.segmentCount -
+                      1);
+  }
+
+  // each worker must own at least two segments
+  static uint32_t max_workers(const binary_fuse_layout_t &layout) {
+    return layout.segmentCount < 4 ? 1 : layout.segmentCount / 2;
+  }
+
+  // Step 1: append the hash of keys[0, n) under seed to the bucket of the
+  // worker owning it, buckets having one entry per worker.
+  static void route(const binary_fuse_layout_t &layout, uint64_t seed,
+                    const uint64_t *keys, size_t n,
+                    std::vector<std::vector<uint64_t>> &buckets) {
+    uint32_t workers = (uint32_t)buckets.size();
+    for (size_t i = 0; i < n; i++) {
+      uint64_t hash = binary_fuse_mix_split(keys[i], seed);
+      buckets[owner(layout, layout.segment(hash), workers)].push_back(hash);
+    }
+  }
+
+  binary_fuse_segment_worker_t(const binary_fuse_layout_t &layout,
+                               uint32_t worker, uint32_t workers)
+      : _layout(layout), _roundStart(0) {
+    if (workers == 0 || workers > max_workers(layout) || worker >= workers) {
+      throw std::runtime_error("invalid worker");
+    }
+    _begin = segment_begin(layout, worker, workers) * layout.segmentLength;
+    _end = (worker + 1 == workers)
+               ? layout.arrayLength
+               : segment_begin(layout, worker + 1, workers) *
+                     layout.segmentLength;
+  }
+
+  // hashes routed to this worker
+  void add(const uint64_t *hashes, size_t n) {
+    _hashes.insert(_hashes.end(), hashes, hashes + n);
+  }
+
+  // Once all hashes are added: removes the duplicates and returns the hashes
+  // that the next worker must add_boundary().
+  std::vector<uint64_t> boundary() {
+    std::sort(_hashes.begin(), _hashes.end());
+    _hashes.erase(std::unique(_hashes.begin(), _hashes.end()), _hashes.end());
+    std::vector<uint64_t> spill;
+    for (uint64_t hash : _hashes) {
+      if (_layout.position(2, hash) >= _end) {
+        spill.push_back(hash);
+      }
+    }
+    return spill;
+  }
+
+  void add_boundary(const uint64_t *hashes, size_t n) {
+    _boundary.insert(_boundary.end(), hashes, hashes + n);
+  }
+
+  // Step 2: count the keys of every owned set. Returns false when a set
+  // overflows, in which case populate() would also try another seed.
+  bool count() {
+    _count.assign(_end - _begin, 0);
+    _xor.assign(_end - _begin, 0);
+    bool ok = true;
+    for (const std::vector<uint64_t> *v : {&_hashes, &_boundary}) {
+      for (uint64_t hash : *v) {
+        for (int j = 0; j < 3; j++) {
+          uint32_t p = _layout.position(j, hash);
+          if (p >= _begin && p < _end) {
+            p -= _begin;
+            _count[p]++;
+            _xor[p] ^= hash;
+            ok = ok && (_count[p] < 64);
+          }
+        }
+      }
+    }
+    _frontier.clear();
+    for (uint32_t p = 0; p < _end - _begin; p++) {
+      if (_count[p] == 1) {
+        _frontier.push_back(p + _begin);
+      }
+    }
+    return ok;
+  }
+
+  size_t frontier_size() const { return _frontier.size(); }
+
+  // sets holding a single key in the last two segments, which the next
+  // worker needs to claim()
+  std::vector<uint32_t> frontier_tail() const {
+    uint32_t tail = (_end - _begin > 2 * _layout.segmentLength)
+                        ? _end - 2 * _layout.segmentLength
+                        : _begin;
+    std::vector<uint32_t> answer;
+    for (uint32_t p : _frontier) {
+      if (p >= tail && _count[p - _begin] == 1) {
+        answer.push_back(p);
+      }
+    }
+    std::sort(answer.begin(), answer.end());
+    return answer;
+  }
+
+  // Releases the keys alone in an owned set at the start of the round, unless
+  // they are alone in a lower set. left_tail is the frontier_tail() of the
+  // previous worker. The released hashes that live in the previous (resp.
+  // next) range are appended to to_left (resp. to_right).
+  void claim(const std::vector<uint32_t> &left_tail,
+             std::vector<uint64_t> &to_left, std::vector<uint64_t> &to_right) {
+    _roundStart = _peeled.size();
+    for (uint32_t p : _frontier) {
+      if (_count[p - _begin] != 1) {
+        continue;
+      }
+      uint64_t hash = _xor[p - _begin];
+      uint32_t h[3];
+      for (int j = 0; j < 3; j++) {
+        h[j] = _layout.position(j, hash);
+      }
+      uint8_t found = (h[0] == p) ? 0 : ((h[1] == p) ? 1 : 2);
+      bool lower = false;
+      for (uint8_t j = 0; j < found; j++) {
+        lower |= (h[j] >= _begin)
+                     ? (_count[h[j] - _begin] == 1)
+                     : std::binary_search(left_tail.begin(), left_tail.end(),
+                                          h[j]);
+      }
+      if (lower) {
+        continue;
+      }
+      _peeled.push_back(hash);
+      _found.push_back(found);
+      if (h[0] < _begin) {
+        to_left.push_back(hash);
+      }
+      if (h[2] >= _end) {
+        to_right.push_back(hash);
+      }
+    }
+  }
+
+  // Removes the keys released in this round by this worker and by its
+  // neighbors, and collects the new frontier. Returns its size.
+  size_t apply(const std::vector<uint64_t> &from_left,
+               const std::vector<uint64_t> &from_right) {
+    _frontier.clear();
+    for (size_t i = _roundStart; i < _peeled.size(); i++) {
+      remove(_peeled[i], true);
+    }
+    for (uint64_t hash : from_left) {
+      remove(hash, true);
+    }
+    for (uint64_t hash : from_right) {
+      remove(hash, true);
+    }
+    _roundEnds.push_back((uint32_t)_peeled.size());
+    return _frontier.size();
+  }
+
+  // number of distinct keys whose first position is owned
+  size_t key_count() const { return _hashes.size(); }
+
+  // Step 3: the released hashes, in rounds: round r spans
+  // [round_ends()[r-1], round_ends()[r]).
+  const std::vector<uint64_t> &peeled() const { return _peeled; }
+
+  const std::vector<uint8_t> &found() const { return _found; }
+
+  const std::vector<uint32_t> &round_ends() const { return _roundEnds; }
+};
+
+// Step 3: assigns the fingerprints from the output of all the workers. The
+// rounds are walked backward where they lie, without gathering them.
+template <typename T>
+void binary_fuse_assemble(
+    binary_fuse_t<T> &filter, uint64_t seed,
+    const std::vector<std::vector<uint64_t>> &peeled,
+    const std::vector<std::vector<uint8_t>> &found,
+    const std::vector<std::vector<uint32_t>> &round_ends) {
+  size_t rounds = 0;
+  for (size_t w = 0; w < peeled.size(); w++) {
+    rounds = std::max(rounds, round_ends[w].size());
+  }
+  filter.assign(seed, nullptr, nullptr, 0);
+  for (size_t r = rounds; r-- > 0;) {
+    for (size_t w = 0; w < peeled.size(); w++) {
+      if (r >= round_ends[w].size()) {
+        continue;
+      }
+      size_t start = (r == 0) ? 0 : round_ends[w][r - 1];
+      filter.assign_earlier(peeled[w].data() + start, found[w].data() + start,
+                            (uint32_t)(round_ends[w][r] - start));
+    }
+  }
+}
+
+//////////////////
+// local multi-process harness
+//////////////////
+
+enum binary_fuse_worker_command_t : uint8_t {
+  BINARY_FUSE_CMD_ROUTE,    // seed -> (), hash the share of the keys
+  BINARY_FUSE_CMD_SEND,     // () -> one bucket per other worker
+  BINARY_FUSE_CMD_ADD,      // hashes -> ()
+  BINARY_FUSE_CMD_BOUNDARY, // () -> hashes for the next worker
+  BINARY_FUSE_CMD_COUNT,    // boundary hashes -> ok, frontier size, tail
+  BINARY_FUSE_CMD_CLAIM,    // left tail -> to_left, to_right
+  BINARY_FUSE_CMD_APPLY,    // from_left, from_right -> frontier size, tail
+  BINARY_FUSE_CMD_RESULT,   // () -> key count, peeled, found, round ends
+  BINARY_FUSE_CMD_EXIT
+};
+
+// Blocks SIGPIPE in the calling thread while alive, so that writing to the
+// pipe of a dead worker fails with EPIPE instead of killing the process. A
+// SIGPIPE raised meanwhile is discarded.
+class binary_fuse_sigpipe_guard_t {
+private:
+  sigset_t _set;
+  sigset_t _old;
+  bool _wasPending;
+
+public:
+  binary_fuse_sigpipe_guard_t() {
+    sigemptyset(&_set);
+    sigaddset(&_set, SIGPIPE);
+    sigset_t pending;
+    sigpending(&pending);
+    _wasPending = sigismember(&pending, SIGPIPE) == 1;
+    pthread_sigmask(SIG_BLOCK, &_set, &_old);
+  }
+
+  binary_fuse_sigpipe_guard_t(const binary_fuse_sigpipe_guard_t &) = delete;
+  binary_fuse_sigpipe_guard_t &
+  operator=(const binary_fuse_sigpipe_guard_t &) = delete;
+
+  ~binary_fuse_sigpipe_guard_t() {
+    sigset_t pending;
+    sigpending(&pending);
+    if (!_wasPending && sigismember(&pending, SIGPIPE) == 1) {
+      int sig;
+      sigwait(&_set, &sig);
+    }
+    pthread_sigmask(SIG_SETMASK, &_old, NULL);
+  }
+};
+
+static inline void binary_fuse_write_all(int fd, const void *data,
+                                         size_t bytes) {
+  const char *p = (const char *)data;
+  while (bytes > 0) {
+    ssize_t w = write(fd, p, bytes);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      throw std::runtime_error("failed to write to a worker pipe");
+    }
+    p += w;
+    bytes -= (size_t)w;
+  }
+}
+
+static inline void binary_fuse_read_all(int fd, void *data, size_t bytes) {
+  char *p = (char *)data;
+  while (bytes > 0) {
+    ssize_t r = read(fd, p, bytes);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      throw std::runtime_error("failed to read from a worker pipe");
+    }
+    p += r;
+    bytes -= (size_t)r;
+  }
+}
+
+template <typename U>
+static inline void binary_fuse_send(int fd, const U &value) {
+  binary_fuse_write_all(fd, &value, sizeof(value));
+}
+
+template <typename U>
+static inline U binary_fuse_receive(int fd) {
+  U value;
+  binary_fuse_read_all(fd, &value, sizeof(value));
+  return value;
+}
+
+template <typename U>
+static inline void binary_fuse_send_vector(int fd, const std::vector<U> &v) {
+  binary_fuse_send<uint64_t>(fd, v.size());
+  binary_fuse_write_all(fd, v.data(), v.size() * sizeof(U));
+}
+
+template <typename U>
+static inline std::vector<U> binary_fuse_receive_vector(int fd) {
+  std::vector<U> v(binary_fuse_receive<uint64_t>(fd));
+  binary_fuse_read_all(fd, v.data(), v.size() * sizeof(U));
+  return v;
+}
+
+// Body of a worker process: serves the commands read from 'in' on its share
+// keys[0, n) of the keys, answering on 'out'.
+static inline void binary_fuse_worker_serve(const binary_fuse_layout_t &layout,
+                                            uint32_t worker, uint32_t workers,
+                                            const uint64_t *keys, size_t n,
+                                            int in, int out) {
+  std::unique_ptr<binary_fuse_segment_worker_t> state;
+  std::vector<std::vector<uint64_t>> buckets;
+  while (true) {
+    uint8_t command = binary_fuse_receive<uint8_t>(in);
+    switch (command) {
+    case BINARY_FUSE_CMD_ROUTE: {
+      uint64_t seed = binary_fuse_receive<uint64_t>(in);
+      state.reset(new binary_fuse_segment_worker_t(layout, worker, workers));
+      buckets.assign(workers, std::vector<uint64_t>());
+      binary_fuse_segment_worker_t::route(layout, seed, keys, n, buckets);
+      state->add(buckets[worker].data(), buckets[worker].size());
+      buckets[worker] = std::vector<uint64_t>();
+      binary_fuse_send<uint8_t>(out, 1);
+      break;
+    }
+    case BINARY_FUSE_CMD_SEND:
+      for (uint32_t w = 0; w < workers; w++) {
+        if (w != worker) {
+          binary_fuse_send_vector(out, buckets[w]);
+          buckets[w] = std::vector<uint64_t>();
+        }
+      }
+      break;
+    case BINARY_FUSE_CMD_ADD: {
+      std::vector<uint64_t> hashes = binary_fuse_receive_vector<uint64_t>(in);
+      state->add(hashes.data(), hashes.size());
+      binary_fuse_send<uint8_t>(out, 1);
+      break;
+    }
+    case BINARY_FUSE_CMD_BOUNDARY:
+      binary_fuse_send_vector(out, state->boundary());
+      break;
+    case BINARY_FUSE_CMD_COUNT: {
+      std::vector<uint64_t> hashes = binary_fuse_receive_vector<uint64_t>(in);
+      state->add_boundary(hashes.data(), hashes.size());
+      binary_fuse_send<uint8_t>(out, state->count() ? 1 : 0);
+      binary_fuse_send<uint64_t>(out, state->frontier_size());
+      binary_fuse_send_vector(out, state->frontier_tail());
+      break;
+    }
+    case BINARY_FUSE_CMD_CLAIM: {
+      std::vector<uint32_t> tail = binary_fuse_receive_vector<uint32_t>(in);
+      std::vector<uint64_t> to_left, to_right;
+      state->claim(tail, to_left, to_right);
+      binary_fuse_send_vector(out, to_left);
+      binary_fuse_send_vector(out, to_right);
+      break;
+    }
+    case BINARY_FUSE_CMD_APPLY: {
+      std::vector<uint64_t> from_left = binary_fuse_receive_vector<uint64_t>(in);
+      std::vector<uint64_t> from_right =
+          binary_fuse_receive_vector<uint64_t>(in);
+      binary_fuse_send<uint64_t>(out, state->apply(from_left, from_right));
+      binary_fuse_send_vector(out, state->frontier_tail());
+      break;
+    }
+    case BINARY_FUSE_CMD_RESULT:
+      binary_fuse_send<uint64_t>(out, state->key_count());
+      binary_fuse_send_vector(out, state->peeled());
+      binary_fuse_send_vector(out, state->found());
+      binary_fuse_send_vector(out, state->round_ends());
+      break;
+    default:
+      return;
+    }
+  }
+}
+
+// Builds the filter with 'workers' local processes (fewer if the filter has
+// too few segments), each holding the temporary memory of its segment range
+// only. Returns false when every seed failed, like populate(), which it
+// matches bit for bit. The processes are forked: call it from a
+// single-threaded program.
+template <typename T>
+bool binary_fuse_multiprocess_populate(
+    binary_fuse_t<T> &filter, const std::vector<uint64_t> &keys,
+    uint32_t workers, uint64_t rng_seed = binary_fuse_t<T>::default_rng_seed) {
+  binary_fuse_layout_t layout = filter.layout();
+  workers = std::max<uint32_t>(
+      1, std::min(workers, binary_fuse_segment_worker_t::max_workers(layout)));
+  // a worker that dies makes the next command fail, and shutdown() run
+  binary_fuse_sigpipe_guard_t sigpipeGuard;
+
+  struct process_t {
+    pid_t pid;
+    int in;  // commands
+    int out; // answers
+  };
+  std::vector<process_t> processes;
+  auto shutdown = [&processes]() {
+    for (process_t &p : processes) {
+      close(p.in);
+      close(p.out);
+      waitpid(p.pid, NULL, 0);
+    }
+    processes.clear();
+  };
+  for (uint32_t w = 0; w < workers; w++) {
+    int commands[2], answers[2];
+    if (pipe(commands) != 0) {
+      shutdown();
+      throw std::runtime_error("cannot create a pipe");
+    }
+    if (pipe(answers) != 0) {
+      close(commands[0]);
+      close(commands[1]);
+      shutdown();
+      throw std::runtime_error("cannot create a pipe");
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+      close(commands[0]);
+      close(commands[1]);
+      close(answers[0]);
+      close(answers[1]);
+      shutdown();
+      throw std::runtime_error("cannot fork a worker");
+    }
+    if (pid == 0) {
+      for (process_t &p : processes) {
+        close(p.in);
+        close(p.out);
+      }
+      close(commands[1]);
+      close(answers[0]);
+      size_t begin = keys.size() * w / workers;
+      size_t end = keys.size() * (w + 1) / workers;
+      int status = 0;
+      try {
+        binary_fuse_worker_serve(layout, w, workers, keys.data() + begin,
+                                 end - begin, commands[0], answers[1]);
+      } catch (...) {
+        status = 1;
+      }
+      _exit(status);
+    }
+    close(commands[0]);
+    close(answers[1]);
+    processes.push_back({pid, commands[1], answers[0]});
+  }
+
+  bool success = false;
+  try {
+    uint64_t rng_counter = rng_seed;
+    for (int loop = 0; !success && loop < XOR_MAX_ITERATIONS; ++loop) {
+      uint64_t seed = binary_fuse_rng_splitmix64(&rng_counter);
+      // Step 1: hash and route
+      for (process_t &p : processes) {
+        binary_fuse_send<uint8_t>(p.in, BINARY_FUSE_CMD_ROUTE);
+        binary_fuse_send<uint64_t>(p.in, seed);
+      }
+      for (process_t &p : processes) {
+        binary_fuse_receive<uint8_t>(p.out);
+      }
+      for (uint32_t from = 0; from < workers; from++) {
+        binary_fuse_send<uint8_t>(processes[from].in, BINARY_FUSE_CMD_SEND);
+        for (uint32_t to = 0; to < workers; to++) {
+          if (to == from) {
+            continue;
+          }
+          std::vector<uint64_t> bucket =
+              binary_fuse_receive_vector<uint64_t>(processes[from].out);
+          binary_fuse_send<uint8_t>(processes[to].in, BINARY_FUSE_CMD_ADD);
+          binary_fuse_send_vector(processes[to].in, bucket);
+          binary_fuse_receive<uint8_t>(processes[to].out);
+        }
+      }
+      std::vector<std::vector<uint64_t>> spill(workers);
+      for (process_t &p : processes) {
+        binary_fuse_send<uint8_t>(p.in, BINARY_FUSE_CMD_BOUNDARY);
+      }
+      for (uint32_t w = 0; w < workers; w++) {
+        spill[w] = binary_fuse_receive_vector<uint64_t>(processes[w].out);
+      }
+      // Step 2: count and peel
+      for (uint32_t w = 0; w < workers; w++) {
+        binary_fuse_send<uint8_t>(processes[w].in, BINARY_FUSE_CMD_COUNT);
+        binary_fuse_send_vector(processes[w].in,
+                                w == 0 ? std::vector<uint64_t>() : spill[w - 1]);
+      }
+      spill.clear();
+      bool ok = true;
+      uint64_t frontier = 0;
+      std::vector<std::vector<uint32_t>> tails(workers);
+      for (uint32_t w = 0; w < workers; w++) {
+        ok &= (binary_fuse_receive<uint8_t>(processes[w].out) != 0);
+        frontier += binary_fuse_receive<uint64_t>(processes[w].out);
+        tails[w] = binary_fuse_receive_vector<uint32_t>(processes[w].out);
+      }
+      if (!ok) {
+        continue;
+      }
+      std::vector<std::vector<uint64_t>> to_left(workers), to_right(workers);
+      while (frontier > 0) {
+        for (uint32_t w = 0; w < workers; w++) {
+          binary_fuse_send<uint8_t>(processes[w].in, BINARY_FUSE_CMD_CLAIM);
+          binary_fuse_send_vector(processes[w].in,
+                                  w == 0 ? std::vector<uint32_t>()
+                                         : tails[w - 1]);
+        }
+        for (uint32_t w = 0; w < workers; w++) {
+          to_left[w] = binary_fuse_receive_vector<uint64_t>(processes[w].out);
+          to_right[w] = binary_fuse_receive_vector<uint64_t>(processes[w].out);
+        }
+        for (uint32_t w = 0; w < workers; w++) {
+          binary_fuse_send<uint8_t>(processes[w].in, BINARY_FUSE_CMD_APPLY);
+          binary_fuse_send_vector(processes[w].in,
+                                  w == 0 ? std::vector<uint64_t>()
+                                         : to_right[w - 1]);
+          binary_fuse_send_vector(processes[w].in,
+                                  w + 1 == workers ? std::vector<uint64_t>()
+                                                   : to_left[w + 1]);
+        }
+        frontier = 0;
+        for (uint32_t w = 0; w < workers; w++) {
+          frontier += binary_fuse_receive<uint64_t>(processes[w].out);
+          tails[w] = binary_fuse_receive_vector<uint32_t>(processes[w].out);
+        }
+      }
+      // Step 3: gather and assemble
+      std::vector<std::vector<uint64_t>> peeled(workers);
+      std::vector<std::vector<uint8_t>> found(workers);
+      std::vector<std::vector<uint32_t>> round_ends(workers);
+      size_t keyCount = 0;
+      size_t peeledCount = 0;
+      for (process_t &p : processes) {
+        binary_fuse_send<uint8_t>(p.in, BINARY_FUSE_CMD_RESULT);
+      }
+      for (uint32_t w = 0; w < workers; w++) {
+        keyCount += binary_fuse_receive<uint64_t>(processes[w].out);
+        peeled[w] = binary_fuse_receive_vector<uint64_t>(processes[w].out);
+        found[w] = binary_fuse_receive_vector<uint8_t>(processes[w].out);
+        round_ends[w] = binary_fuse_receive_vector<uint32_t>(processes[w].out);
+        peeledCount += peeled[w].size();
+      }
+      if (peeledCount == keyCount) {
+        binary_fuse_assemble(filter, seed, peeled, found, round_ends);
+        success = true;
+      }
+    }
+    for (process_t &p : processes) {
+      binary_fuse_send<uint8_t>(p.in, BINARY_FUSE_CMD_EXIT);
+    }
+  } catch (...) {
+    shutdown();
+    throw;
+  }
+  shutdown();
+  return success;
+}
+
+#endif
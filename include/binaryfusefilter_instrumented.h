@@ -0,0 +1,285 @@
+#ifndef BINARYFUSEFILTER_INSTRUMENTED_H
+#define BINARYFUSEFILTER_INSTRUMENTED_H
+#include "binaryfusefilter.h"
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+
+/**
+ * Opt-in query instrumentation.
+ *
+ * binary_fuse_instrumented_t wraps a filter (binary_fuse_t or
+ * binary_fuse_paged_t) and counts the queries, the positives and the latency
+ * of the calls, in counters owned by each thread. The application reports the
+ * outcome of positives it could check through report() (or the reporter()
+ * callback), from which the live false positive rate is estimated and can be
+ * compared to the theoretical one, 2^-bits.
+ *
+ * The second template parameter, Enabled, turns the recording on. Disabled,
+ * the wrapper holds nothing but the filter, only forwards to it, and stats()
+ * is all zeros. To switch at build time, pass
+ * BINARY_FUSE_INSTRUMENTATION_ENABLED, which is true when
+ * BINARY_FUSE_INSTRUMENTATION is defined: translation units may disagree on
+ * the macro, they then name two distinct types.
+ ***/
+
+#ifdef BINARY_FUSE_INSTRUMENTATION
+#define BINARY_FUSE_INSTRUMENTATION_ENABLED true
+#else
+#define BINARY_FUSE_INSTRUMENTATION_ENABLED false
+#endif
+
+#define BINARY_FUSE_LATENCY_BUCKETS 32
+
+struct binary_fuse_query_stats_t {
+  uint64_t queries;
+  uint64_t positives;
+  uint64_t true_positives;  // reported by the application
+  uint64_t false_positives; // reported by the application
+  // latency[i] counts the timed calls that took [2^i, 2^(i+1)) nanoseconds
+  uint64_t latency[BINARY_FUSE_LATENCY_BUCKETS];
+
+  // False positive rate among the queried keys that are not in the set. The
+  // reported outcomes may be a sample of the positives: they are extrapolated
+  // to all of them.
+  double estimated_fpr() const {
+    uint64_t reported = true_positives + false_positives;
+    if (reported == 0) {
+      return 0.0;
+    }
+    double fp = (double)positives * false_positives / reported;
+    double negatives =
+        (double)queries - (double)positives * true_positives / reported;
+    return negatives > 0 ? fp / negatives : 0.0;
+  }
+};
+
+// Counters of one thread for one filter. Only the owning thread writes them,
+// with plain relaxed load/store pairs, so no cache line is ever contended.
+struct alignas(64) binary_fuse_thread_counters_t {
+  std::atomic<uint64_t> calls{0}; // of contain() and contain_batch()
+  std::atomic<uint64_t> queries{0};
+  std::atomic<uint64_t> positives{0};
+  std::atomic<uint64_t> true_positives{0};
+  std::atomic<uint64_t> false_positives{0};
+  std::atomic<uint64_t> latency[BINARY_FUSE_LATENCY_BUCKETS] = {};
+};
+
+static inline void binary_fuse_bump(std::atomic<uint64_t> &counter,
+                                    uint64_t by) {
+  counter.store(counter.load(std::memory_order_relaxed) + by,
+                std::memory_order_relaxed);
+}
+
+// Identifiers are never reused, so that a stale entry of a thread cache cannot
+// match a filter created at the address of a destroyed one.
+inline uint64_t binary_fuse_next_instrumentation_id() {
+  static std::atomic<uint64_t> next{1};
+  return next.fetch_add(1, std::memory_order_relaxed);
+}
+
+#define BINARY_FUSE_THREAD_CACHE_SIZE 256
+
+// The (filter, counters) pairs used by the current thread, indexed by the low
+// bits of the identifier. Identifiers are consecutive, so a thread can use
+// any BINARY_FUSE_THREAD_CACHE_SIZE filters created in a row without ever
+// taking a lock.
+struct binary_fuse_thread_cache_t {
+  uint64_t id[BINARY_FUSE_THREAD_CACHE_SIZE];
+  binary_fuse_thread_counters_t *counters[BINARY_FUSE_THREAD_CACHE_SIZE];
+};
+
+inline binary_fuse_thread_cache_t &binary_fuse_thread_cache() {
+  static thread_local binary_fuse_thread_cache_t cache = {};
+  return cache;
+}
+
+template <typename Filter, bool Enabled> class binary_fuse_instrumented_t {
+private:
+  const Filter &_filter;
+  uint64_t _id;
+  uint64_t _sampleMask;
+  mutable std::mutex _mutex;
+  mutable std::unordered_map<std::thread::id,
+                             std::unique_ptr<binary_fuse_thread_counters_t>>
+      _counters;
+
+  binary_fuse_thread_counters_t &counters() const {
+    binary_fuse_thread_cache_t &cache = binary_fuse_thread_cache();
+    size_t slot = _id % BINARY_FUSE_THREAD_CACHE_SIZE;
+    if (cache.id[slot] == _id) {
+      return *cache.counters[slot];
+    }
+    binary_fuse_thread_counters_t *c;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      std::unique_ptr<binary_fuse_thread_counters_t> &owned =
+          _counters[std::this_thread::get_id()];
+      if (!owned) {
+        owned.reset(new binary_fuse_thread_counters_t());
+      }
+      c = owned.get();
+    }
+    cache.id[slot] = _id;
+    cache.counters[slot] = c;
+    return *c;
+  }
+
+  static void record_latency(binary_fuse_thread_counters_t &c,
+                             std::chrono::steady_clock::time_point start) {
+    uint64_t ns = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - start)
+                      .count();
+    size_t bucket = 0;
+    while (ns > 1 && bucket + 1 < BINARY_FUSE_LATENCY_BUCKETS) {
+      ns >>= 1;
+      bucket++;
+    }
+    binary_fuse_bump(c.latency[bucket], 1);
+  }
+
+  // whether the current call of this thread is to be timed
+  bool sampled(binary_fuse_thread_counters_t &c) const {
+    uint64_t calls = c.calls.load(std::memory_order_relaxed);
+    binary_fuse_bump(c.calls, 1);
+    return (calls & _sampleMask) == 0;
+  }
+
+public:
+  static constexpr bool enabled = true;
+
+  // The filter must outlive the wrapper. One call out of every
+  // 'latency_sampling' (a power of two) per thread is timed: reading the
+  // clock costs more than a query.
+  explicit binary_fuse_instrumented_t(const Filter &filter,
+                                      uint64_t latency_sampling = 1024)
+      : _filter(filter) {
+    if (latency_sampling == 0 ||
+        (latency_sampling & (latency_sampling - 1)) != 0) {
+      throw std::runtime_error("latency sampling should be a power of two");
+    }
+    _id = binary_fuse_next_instrumentation_id();
+    _sampleMask = latency_sampling - 1;
+  }
+
+  binary_fuse_instrumented_t(const binary_fuse_instrumented_t &) = delete;
+  binary_fuse_instrumented_t &
+  operator=(const binary_fuse_instrumented_t &) = delete;
+
+  bool contain(uint64_t key) const {
+    binary_fuse_thread_counters_t &c = counters();
+    bool timed = sampled(c);
+    std::chrono::steady_clock::time_point start;
+    if (timed) {
+      start = std::chrono::steady_clock::now();
+    }
+    bool answer = _filter.contain(key);
+    if (timed) {
+      record_latency(c, start);
+    }
+    binary_fuse_bump(c.queries, 1);
+    binary_fuse_bump(c.positives, answer ? 1 : 0);
+    return answer;
+  }
+
+  // The latency of a batch is recorded as that of a single call.
+  void contain_batch(const uint64_t *keys, size_t n, bool *out) const {
+    binary_fuse_thread_counters_t &c = counters();
+    bool timed = sampled(c);
+    std::chrono::steady_clock::time_point start;
+    if (timed) {
+      start = std::chrono::steady_clock::now();
+    }
+    _filter.contain_batch(keys, n, out);
+    if (timed) {
+      record_latency(c, start);
+    }
+    uint64_t positives = 0;
+    for (size_t i = 0; i < n; i++) {
+      positives += out[i] ? 1 : 0;
+    }
+    binary_fuse_bump(c.queries, n);
+    binary_fuse_bump(c.positives, positives);
+  }
+
+  // Report the outcome of a positive, once the application has checked
+  // whether the key was really in the set.
+  void report(bool true_positive) const {
+    binary_fuse_thread_counters_t &c = counters();
+    binary_fuse_bump(true_positive ? c.true_positives : c.false_positives, 1);
+  }
+
+  // report() as a callback, valid as long as the wrapper
+  std::function<void(bool)> reporter() const {
+    return [this](bool true_positive) { report(true_positive); };
+  }
+
+  // sum of the counters of all threads
+  binary_fuse_query_stats_t stats() const {
+    binary_fuse_query_stats_t s = {};
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const auto &entry : _counters) {
+      const binary_fuse_thread_counters_t &c = *entry.second;
+      s.queries += c.queries.load(std::memory_order_relaxed);
+      s.positives += c.positives.load(std::memory_order_relaxed);
+      s.true_positives += c.true_positives.load(std::memory_order_relaxed);
+      s.false_positives += c.false_positives.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < BINARY_FUSE_LATENCY_BUCKETS; i++) {
+        s.latency[i] += c.latency[i].load(std::memory_order_relaxed);
+      }
+    }
+    return s;
+  }
+
+  // false positive rate of the filter, by design
+  static double theoretical_fpr() {
+    return ldexp(1.0, -(int)(8 * sizeof(typename Filter::fingerprint_t)));
+  }
+
+  const Filter &filter() const { return _filter; }
+};
+
+// The wrapper with the recording turned off: it only forwards to the filter.
+template <typename Filter> class binary_fuse_instrumented_t<Filter, false> {
+private:
+  const Filter &_filter;
+
+public:
+  static constexpr bool enabled = false;
+
+  explicit binary_fuse_instrumented_t(const Filter &filter,
+                                      uint64_t latency_sampling = 1024)
+      : _filter(filter) {
+    (void)latency_sampling;
+  }
+
+  binary_fuse_instrumented_t(const binary_fuse_instrumented_t &) = delete;
+  binary_fuse_instrumented_t &
+  operator=(const binary_fuse_instrumented_t &) = delete;
+
+  bool contain(uint64_t key) const { return _filter.contain(key); }
+
+  void contain_batch(const uint64_t *keys, size_t n, bool *out) const {
+    _filter.contain_batch(keys, n, out);
+  }
+
+  void report(bool true_positive) const { (void)true_positive; }
+
+  std::function<void(bool)> reporter() const {
+    return [](bool true_positive) { (void)true_positive; };
+  }
+
+  binary_fuse_query_stats_t stats() const { return {}; }
+
+  static double theoretical_fpr() {
+    return binary_fuse_instrumented_t<Filter, true>::theoretical_fpr();
+  }
+
+  const Filter &filter() const { return _filter; }
+};
+
+#endif
@@ -0,0 +1,319 @@
+#ifndef BINARYFUSEFILTER_PAGED_H
+#define BINARYFUSEFILTER_PAGED_H
+#include "binaryfusefilter.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <future>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+/**
+ * Lazy, paged storage for binary fuse filters that are kept on disk.
+ *
+ * The file is the output of binary_fuse_t::serialize(). Only the header is
+ * read when the filter is opened: the fingerprints are split into fixed-size
+ * pages which are read with pread() on demand, and kept in a bounded LRU
+ * cache that can be shared by any number of paged filters.
+ ***/
+
+//////////////////
+// page cache
+//////////////////
+
+class binary_fuse_page_cache_t {
+public:
+  typedef std::shared_ptr<const std::vector<char>> page_ptr;
+
+  struct stats_t {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+  };
+
+  // page_bytes is the size of a page, capacity the maximal number of pages
+  // held by the cache.
+  binary_fuse_page_cache_t(size_t page_bytes, size_t capacity)
+      : _pageBytes(page_bytes), _capacity(capacity), _nextFileId(0),
+        _hits(0), _misses(0), _evictions(0) {
+    if (page_bytes == 0 || capacity == 0) {
+      throw std::runtime_error("page size and capacity should be positive");
+    }
+  }
+
+  binary_fuse_page_cache_t(const binary_fuse_page_cache_t &) = delete;
+  binary_fuse_page_cache_t &operator=(const binary_fuse_page_cache_t &) = delete;
+
+  size_t page_bytes() const { return _pageBytes; }
+
+  size_t capacity() const { return _capacity; }
+
+  // returns an identifier under which the pages of a file are cached
+  uint32_t register_file() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _nextFileId++;
+  }
+
+  // drop all the pages of a file, e.g., when it is closed
+  void forget(uint32_t file_id) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto it = _lru.begin(); it != _lru.end();) {
+      if ((uint32_t)(it->first >> 32) == file_id) {
+        _index.erase(it->first);
+        it = _lru.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  // Returns the page, reading 'bytes' bytes at 'offset' in fd when it is not
+  // cached. The returned page stays valid even if it is evicted meanwhile.
+  page_ptr fetch(uint32_t file_id, uint32_t page, int fd, off_t offset,
+                 size_t bytes) {
+    uint64_t id = ((uint64_t)file_id << 32) | page;
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+      auto it = _index.find(id);
+      if (it != _index.end()) {
+        _lru.splice(_lru.begin(), _lru, it->second);
+        _hits++;
+        return it->second->second;
+      }
+    }
+    // the read happens outside of the lock: other threads keep being served
+    auto data = std::make_shared<std::vector<char>>(bytes);
+    size_t done = 0;
+    while (done < bytes) {
+      ssize_t r = pread(fd, data->data() + done, bytes - done,
+                        offset + (off_t)done);
+      if (r < 0 && errno == EINTR) {
+        continue;
+      }
+      if (r <= 0) {
+        throw std::runtime_error("failed to read a filter page");
+      }
+      done += (size_t)r;
+    }
+    std::lock_guard<std::mutex> lock(_mutex);
+    _misses++;
+    auto it = _index.find(id);
+    if (it != _index.end()) {
+      // another thread loaded the same page concurrently
+      _lru.splice(_lru.begin(), _lru, it->second);
+      return it->second->second;
+    }
+    _lru.emplace_front(id, data);
+    _index[id] = _lru.begin();
+    if (_lru.size() > _capacity) {
+      _index.erase(_lru.back().first);
+      _lru.pop_back();
+      _evictions++;
+    }
+    return data;
+  }
+
+  stats_t stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    stats_t s;
+    s.hits = _hits;
+    s.misses = _misses;
+    s.evictions = _evictions;
+    return s;
+  }
+
+  void reset_stats() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _hits = 0;
+    _misses = 0;
+    _evictions = 0;
+  }
+
+private:
+  typedef std::list<std::pair<uint64_t, page_ptr>> lru_list;
+
+  size_t _pageBytes;
+  size_t _capacity;
+  uint32_t _nextFileId;
+  uint64_t _hits;
+  uint64_t _misses;
+  uint64_t _evictions;
+  mutable std::mutex _mutex;
+  lru_list _lru; // most recently used first
+  std::unordered_map<uint64_t, lru_list::iterator> _index;
+};
+
+//////////////////
+// paged fuseT
+//////////////////
+
+// write the serialized filter to path, returns true on success
+template <typename T>
+bool binary_fuse_save(const binary_fuse_t<T> &filter, const char *path) {
+  std::vector<char> buffer(filter.serialization_bytes());
+  filter.serialize(buffer.data());
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) {
+    return false;
+  }
+  bool ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+  return (fclose(file) == 0) && ok;
+}
+
+template <typename T,
+          class = typename std::enable_if_t<std::is_unsigned<T>::value>>
+class binary_fuse_paged_t {
+private:
+  uint64_t _seed;
+  binary_fuse_layout_t _layout;
+  uint32_t _pageLength; // fingerprints per page
+  uint32_t _fileId;
+  int _fd;
+  std::shared_ptr<binary_fuse_page_cache_t> _cache;
+
+  binary_fuse_page_cache_t::page_ptr page(uint32_t index) const {
+    uint64_t first = (uint64_t)index * _pageLength;
+    uint64_t count = std::min<uint64_t>(_pageLength, _layout.arrayLength - first);
+    off_t offset = (off_t)(binary_fuse_t<T>::serialization_header_bytes() +
+                           first * sizeof(T));
+    return _cache->fetch(_fileId, index, _fd, offset, count * sizeof(T));
+  }
+
+  T fingerprint_in(const binary_fuse_page_cache_t::page_ptr &p,
+                   uint32_t index) const {
+    T f;
+    memcpy(&f, p->data() + (size_t)(index % _pageLength) * sizeof(T),
+           sizeof(T));
+    return f;
+  }
+
+  T fingerprint(uint32_t index) const {
+    return fingerprint_in(page(index / _pageLength), index);
+  }
+
+public:
+  typedef T fingerprint_t;
+
+  // open a filter written by binary_fuse_save (or binary_fuse_t::serialize),
+  // the pages of which are cached in 'cache'.
+  binary_fuse_paged_t(const char *path,
+                      std::shared_ptr<binary_fuse_page_cache_t> cache)
+      : _cache(std::move(cache)) {
+    if (_cache->page_bytes() % sizeof(T) != 0) {
+      throw std::runtime_error("page size should be a multiple of the "
+                               "fingerprint size");
+    }
+    _pageLength = (uint32_t)std::min<size_t>(_cache->page_bytes() / sizeof(T),
+                                             std::numeric_limits<uint32_t>::max());
+    // not inherited by the workers of binary_fuse_multiprocess_populate()
+    _fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (_fd < 0) {
+      throw std::runtime_error("cannot open the filter file");
+    }
+    char header[binary_fuse_t<T>::serialization_header_bytes()];
+    struct stat st;
+    if ((pread(_fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) ||
+        (fstat(_fd, &st) != 0)) {
+      close(_fd);
+      throw std::runtime_error("cannot read the filter header");
+    }
+    const char *buffer = header;
+    memcpy(&_seed, buffer, sizeof(_seed));
+    buffer += sizeof(_seed);
+    memcpy(&_layout.segmentLength, buffer, sizeof(uint32_t));
+    buffer += sizeof(uint32_t);
+    memcpy(&_layout.segmentLengthMask, buffer, sizeof(uint32_t));
+    buffer += sizeof(uint32_t);
+    memcpy(&_layout.segmentCount, buffer, sizeof(uint32_t));
+    buffer += sizeof(uint32_t);
+    memcpy(&_layout.segmentCountLength, buffer, sizeof(uint32_t));
+    buffer += sizeof(uint32_t);
+    memcpy(&_layout.arrayLength, buffer, sizeof(uint32_t));
+    if ((uint64_t)st.st_size !=
+        sizeof(header) + (uint64_t)_layout.arrayLength * sizeof(T)) {
+      close(_fd);
+      throw std::runtime_error("the file is not a filter of this width");
+    }
+    _fileId = _cache->register_file();
+  }
+
+  binary_fuse_paged_t(const binary_fuse_paged_t &) = delete;
+  binary_fuse_paged_t &operator=(const binary_fuse_paged_t &) = delete;
+
+  ~binary_fuse_paged_t() {
+    _cache->forget(_fileId);
+    close(_fd);
+  }
+
+  // Report if the key is in the set, with false positive rate.
+  bool contain(uint64_t key) const {
+    uint64_t hash = binary_fuse_mix_split(key, _seed);
+    T f = binary_fuse_fingerprint(hash);
+    uint32_t h[3];
+    _layout.positions(hash, h);
+    f ^= fingerprint(h[0]) ^ fingerprint(h[1]) ^ fingerprint(h[2]);
+    return f == 0;
+  }
+
+  // out[i] = contain(keys[i]) for i in [0, n). The probes are grouped by
+  // page so that each page is fetched at most once per batch.
+  void contain_batch(const uint64_t *keys, size_t n, bool *out) const {
+    struct probe_t {
+      uint32_t position;
+      size_t key;
+    };
+    std::vector<T> acc(n);
+    std::vector<probe_t> probes(3 * n);
+    for (size_t i = 0; i < n; i++) {
+      uint64_t hash = binary_fuse_mix_split(keys[i], _seed);
+      acc[i] = binary_fuse_fingerprint(hash);
+      uint32_t h[3];
+      _layout.positions(hash, h);
+      probes[3 * i] = {h[0], i};
+      probes[3 * i + 1] = {h[1], i};
+      probes[3 * i + 2] = {h[2], i};
+    }
+    std::sort(probes.begin(), probes.end(),
+              [](const probe_t &a, const probe_t &b) {
+                return a.position < b.position;
+              });
+    binary_fuse_page_cache_t::page_ptr current;
+    uint32_t currentIndex = 0;
+    for (const probe_t &p : probes) {
+      uint32_t index = p.position / _pageLength;
+      if (!current || index != currentIndex) {
+        current = page(index);
+        currentIndex = index;
+      }
+      acc[p.key] ^= fingerprint_in(current, p.position);
+    }
+    for (size_t i = 0; i < n; i++) {
+      out[i] = (acc[i] == 0);
+    }
+  }
+
+  // Runs contain_batch in the background. The keys and out buffers must
+  // remain valid, and the filter alive, until the future is ready.
+  std::future<void> contain_batch_async(const uint64_t *keys, size_t n,
+                                        bool *out) const {
+    return std::async(std::launch::async,
+                      [this, keys, n, out] { contain_batch(keys, n, out); });
+  }
+
+  // number of fingerprints in the file
+  uint32_t array_length() const { return _layout.arrayLength; }
+
+  const binary_fuse_page_cache_t &cache() const { return *_cache; }
+};
+
+typedef binary_fuse_paged_t<uint8_t> binary_fuse8_paged_t;
+typedef binary_fuse_paged_t<uint16_t> binary_fuse16_paged_t;
+typedef binary_fuse_paged_t<uint32_t> binary_fuse32_paged_t;
+
+#endif
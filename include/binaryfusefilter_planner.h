@@ -0,0 +1,498 @@
+#ifndef BINARYFUSEFILTER_PLANNER_H
+#define BINARYFUSEFILTER_PLANNER_H
+#include "binaryfusefilter.h"
+
+#include <chrono>
+
+/**
+ * Sizing planner.
+ *
+ * binary_fuse_plan() picks the fingerprint width (any width from 1 to 32
+ * bits) and the number of shards of a filter from the number of keys, a
+ * target false positive rate and/or a memory budget, and a weighting between
+ * query and construction speed. It predicts the size, the false positive rate
+ * and the construction time from a cost model, which can be measured on the
+ * target machine with binary_fuse_calibrate_cost_model().
+ * binary_fuse_build() then builds the planned filter behind the type-erased
+ * binary_fuse_query_t interface.
+ *
+ * Byte widths (8, 16, 32) use binary_fuse_t directly. Other widths use
+ * binary_fuse_packed_t, which keeps the low bits of the fingerprints of a
+ * binary_fuse32_t: the xor of truncated fingerprints is the truncation of
+ * their xor, so the truncated filter is still valid.
+ ***/
+
+//////////////////
+// packed fuse
+//////////////////
+
+class binary_fuse_packed_t {
+private:
+  uint64_t _seed;
+  uint32_t _size;
+  uint32_t _bits;
+  uint64_t _mask;
+  binary_fuse_layout_t _layout;
+  std::vector<uint8_t> _data; // _bits bits per fingerprint, plus padding
+
+  uint64_t get(uint32_t index) const {
+    uint64_t bit = (uint64_t)index * _bits;
+    uint64_t word;
+    memcpy(&word, &_data[bit >> 3], sizeof(word));
+    return (word >> (bit & 7)) & _mask;
+  }
+
+public:
+  // allocate enough capacity for a set containing up to 'size' elements, with
+  // fingerprints of 'bits' bits (1 to 32). size should be at least 2.
+  binary_fuse_packed_t(uint32_t size, uint32_t bits)
+      : _seed(0), _size(size), _bits(bits) {
+    if (size < 2) {
+      throw std::runtime_error("size should be at least 2");
+    }
+    if (bits == 0 || bits > 32) {
+      throw std::runtime_error("bits should be between 1 and 32");
+    }
+    _mask = (UINT64_C(1) << bits) - 1;
+    _layout = binary_fuse_calculate_layout(size);
+    _data.resize(((uint64_t)_layout.arrayLength * _bits + 7) / 8 +
+                 sizeof(uint64_t));
+  }
+
+  // Report if the key is in the set, with false positive rate 2^-bits.
+  bool contain(uint64_t key) const {
+    uint64_t hash = binary_fuse_mix_split(key, _seed);
+    uint64_t f = binary_fuse_fingerprint(hash) & _mask;
+    uint32_t h[3];
+    _layout.positions(hash, h);
+    f ^= get(h[0]) ^ get(h[1]) ^ get(h[2]);
+    return f == 0;
+  }
+
+  // out[i] = contain(keys[i]) for i in [0, n)
+  void contain_batch(const uint64_t *keys, size_t n, bool *out) const {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = contain(keys[i]);
+    }
+  }
+
+  // report memory usage
+  size_t size_in_bytes() const { return _data.size() + sizeof(*this); }
+
+  uint32_t bits() const { return _bits; }
+
+  // Construct the filter, same contract as binary_fuse_t::populate. The
+  // construction goes through a binary_fuse32_t of the same size.
+  [[nodiscard]] bool
+  populate(std::vector<uint64_t> &keys,
+           uint64_t rng_seed = binary_fuse32_t::default_rng_seed) {
+    binary_fuse32_t full(_size);
+    if (!full.populate(keys, rng_seed)) {
+      return false;
+    }
+    _seed = full.seed();
+    std::fill(_data.begin(), _data.end(), 0);
+    const std::vector<uint32_t> &fingerprints = full.fingerprints();
+    for (uint32_t i = 0; i < _layout.arrayLength; i++) {
+      uint64_t bit = (uint64_t)i * _bits;
+      uint64_t word;
+      memcpy(&word, &_data[bit >> 3], sizeof(word));
+      word |= (fingerprints[i] & _mask) << (bit & 7);
+      memcpy(&_data[bit >> 3], &word, sizeof(word));
+    }
+    return true;
+  }
+};
+
+//////////////////
+// sharding
+//////////////////
+
+// shard of a key, independent of the seeds of the filters
+static inline uint32_t binary_fuse_shard(uint64_t key, uint32_t shards) {
+  return (uint32_t)binary_fuse_mulhi(
+      binary_fuse_murmur64(key ^ UINT64_C(0x9E3779B97F4A7C15)), shards);
+}
+
+template <typename Filter> class binary_fuse_sharded_t {
+private:
+  std::vector<Filter> _shards;
+
+public:
+  explicit binary_fuse_sharded_t(std::vector<Filter> shards)
+      : _shards(std::move(shards)) {}
+
+  bool contain(uint64_t key) const {
+    return _shards[binary_fuse_shard(key, (uint32_t)_shards.size())].contain(
+        key);
+  }
+
+  void contain_batch(const uint64_t *keys, size_t n, bool *out) const {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = contain(keys[i]);
+    }
+  }
+
+  size_t size_in_bytes() const {
+    size_t bytes = sizeof(*this);
+    for (const Filter &f : _shards) {
+      bytes += f.size_in_bytes();
+    }
+    return bytes;
+  }
+};
+
+//////////////////
+// type erasure
+//////////////////
+
+// A filter of any width and sharding. Batches cost a single virtual call:
+// the loop runs in the concrete filter.
+class binary_fuse_query_t {
+public:
+  virtual ~binary_fuse_query_t() {}
+  virtual bool contain(uint64_t key) const = 0;
+  virtual void contain_batch(const uint64_t *keys, size_t n,
+                             bool *out) const = 0;
+  virtual size_t size_in_bytes() const = 0;
+};
+
+template <typename Filter>
+class binary_fuse_query_impl_t final : public binary_fuse_query_t {
+private:
+  Filter _filter;
+
+public:
+  explicit binary_fuse_query_impl_t(Filter filter)
+      : _filter(std::move(filter)) {}
+
+  bool contain(uint64_t key) const override { return _filter.contain(key); }
+
+  void contain_batch(const uint64_t *keys, size_t n,
+                     bool *out) const override {
+    _filter.contain_batch(keys, n, out);
+  }
+
+  size_t size_in_bytes() const override { return _filter.size_in_bytes(); }
+
+  const Filter &filter() const { return _filter; }
+};
+
+//////////////////
+// planning
+//////////////////
+
+// Costs, in nanoseconds per key. A working set beyond cacheBytes costs
+// ...PerDoubling more for every doubling of its size. The defaults were
+// measured on a recent x86-64 server core with a 2 MB L2 cache.
+struct binary_fuse_cost_model_t {
+  double cacheBytes = 2.0 * 1024 * 1024;
+  double buildNs = 40;            // populate(), when it fits in cache
+  double buildNsPerDoubling = 8;
+  double buildBytesPerKey = 24;   // temporary memory of populate()
+  double packNs = 3;              // extra construction cost of other widths
+  double queryNs = 7;             // contain(), when the filter fits in cache
+  double queryNsPerDoubling = 5;
+  double packedQueryNs = 1.5;     // extra query cost of other widths
+  double shardQueryNs = 2;        // extra query cost of sharding
+
+  double build(double keysPerShard, bool packed) const {
+    return buildNs + (packed ? packNs : 0) +
+           buildNsPerDoubling *
+               log2(binary_fuse_max(
+                   1.0, keysPerShard * buildBytesPerKey / cacheBytes));
+  }
+
+  double query(double filterBytes, bool packed, bool sharded) const {
+    return queryNs + (packed ? packedQueryNs : 0) +
+           (sharded ? shardQueryNs : 0) +
+           queryNsPerDoubling *
+               log2(binary_fuse_max(1.0, filterBytes / cacheBytes));
+  }
+};
+
+// Time 'reps' calls of f, in nanoseconds per call.
+template <typename F>
+static inline double binary_fuse_time_ns(F f, size_t reps) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t r = 0; r < reps; r++) {
+    f();
+  }
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now() - start)
+             .count() /
+         (double)reps;
+}
+
+// Measure the cost model on this machine, with a filter fitting in a cache
+// of cacheBytes and a filter 64 times as large. Takes about a second.
+static inline binary_fuse_cost_model_t
+binary_fuse_calibrate_cost_model(double cacheBytes = 2.0 * 1024 * 1024) {
+  binary_fuse_cost_model_t model;
+  model.cacheBytes = cacheBytes;
+  uint32_t small = (uint32_t)binary_fuse_max(
+      1024, cacheBytes / 4 / model.buildBytesPerKey);
+  uint32_t large = small * 64;
+  size_t queries = 1 << 20;
+  uint64_t rng = 1;
+  std::vector<uint64_t> keys(large);
+  for (uint64_t &k : keys) {
+    k = binary_fuse_rng_splitmix64(&rng);
+  }
+  std::vector<uint64_t> probes(queries);
+  for (uint64_t &k : probes) {
+    k = binary_fuse_rng_splitmix64(&rng);
+  }
+  volatile size_t positives = 0; // keeps the queries from being elided
+  auto query_ns = [&](const auto &filter) {
+    return binary_fuse_time_ns(
+               [&]() {
+                 for (uint64_t k : probes) {
+                   positives = positives + (filter.contain(k) ? 1 : 0);
+                 }
+               },
+               1) /
+           (double)queries;
+  };
+
+  std::vector<uint64_t> smallKeys(keys.begin(), keys.begin() + small);
+  binary_fuse8_t smallFilter(small);
+  binary_fuse_packed_t smallPacked(small, 12);
+  double smallBuild =
+      binary_fuse_time_ns([&]() { (void)smallFilter.populate(smallKeys); }, 16) /
+      small;
+  double packedBuild =
+      binary_fuse_time_ns([&]() { (void)smallPacked.populate(smallKeys); }, 16) /
+      small;
+  double smallQuery = query_ns(smallFilter);
+  double packedQuery = query_ns(smallPacked);
+
+  binary_fuse32_t largeFilter(large);
+  double largeBuild =
+      binary_fuse_time_ns([&]() { (void)largeFilter.populate(keys); }, 1) /
+      large;
+  double largeQuery = query_ns(largeFilter);
+
+  model.buildNs = smallBuild;
+  // the 32-bit build is the one packed filters go through
+  model.packNs = binary_fuse_max(0, packedBuild - smallBuild);
+  model.buildNsPerDoubling = binary_fuse_max(
+      0, (largeBuild - smallBuild) /
+             log2(large * model.buildBytesPerKey / cacheBytes));
+  model.queryNs = smallQuery;
+  model.packedQueryNs = binary_fuse_max(0, packedQuery - smallQuery);
+  model.queryNsPerDoubling = binary_fuse_max(
+      0, (largeQuery - smallQuery) /
+             log2((double)largeFilter.size_in_bytes() / cacheBytes));
+  return model;
+}
+
+struct binary_fuse_plan_request_t {
+  uint64_t keys = 0;
+  double targetFpr = 0;          // at most this false positive rate, 0: any
+  uint64_t memoryBudget = 0;     // at most this many bytes, 0: any
+  double queryWeight = 0.5;      // 1: fastest queries, 0: fastest build
+  uint64_t maxShardKeys = std::numeric_limits<uint32_t>::max();
+  binary_fuse_cost_model_t costs;
+};
+
+struct binary_fuse_plan_t {
+  uint32_t bits;         // fingerprint width
+  uint32_t arity;        // positions per key
+  uint32_t shards;
+  uint64_t keysPerShard; // capacity of every shard
+  uint64_t bytes;        // size of the built filter
+  double fpr;            // false positive rate
+  double buildSeconds;   // predicted, on one core
+  double queryNs;        // predicted time of a contain()
+};
+
+// Number of keys every shard is sized for: a bound on the largest shard, when
+// the keys are spread by binary_fuse_shard(). Each shard gets about
+// keys / shards keys, with a standard deviation below sqrt(keys / shards); the
+// largest is about sqrt(2 ln shards) deviations above, and the bound adds 4
+// more so that it is almost never exceeded.
+static inline uint64_t binary_fuse_shard_capacity(uint64_t keys,
+                                                  uint32_t shards) {
+  if (shards <= 1) {
+    return keys;
+  }
+  double mean = ceil((double)keys / shards);
+  return (uint64_t)ceil(mean + (sqrt(2 * log((double)shards)) + 4) *
+                                   sqrt(mean));
+}
+
+// Predictions for a given width and sharding. The size is exact when the
+// number of keys is request.keys: every shard is built for keysPerShard keys.
+static inline binary_fuse_plan_t
+binary_fuse_predict(const binary_fuse_plan_request_t &request, uint32_t bits,
+                    uint32_t shards) {
+  binary_fuse_plan_t plan;
+  plan.bits = bits;
+  plan.arity = 3;
+  plan.shards = shards;
+  plan.keysPerShard = binary_fuse_shard_capacity(request.keys, shards);
+  binary_fuse_layout_t l = binary_fuse_calculate_layout(
+      (uint32_t)std::max<uint64_t>(2, plan.keysPerShard));
+  bool packed = (bits != 8 && bits != 16 && bits != 32);
+  // as reported by size_in_bytes(), packed filters being padded by a word
+  plan.bytes = (uint64_t)shards *
+               (((uint64_t)l.arrayLength * bits + 7) / 8 +
+                (packed ? sizeof(binary_fuse_packed_t) + sizeof(uint64_t)
+                        : sizeof(binary_fuse8_t)));
+  if (shards > 1) {
+    plan.bytes += sizeof(binary_fuse_sharded_t<binary_fuse8_t>);
+  }
+  plan.fpr = ldexp(1.0, -(int)bits);
+  plan.buildSeconds = (double)request.keys *
+                      request.costs.build((double)plan.keysPerShard, packed) *
+                      1e-9;
+  plan.queryNs =
+      request.costs.query((double)plan.bytes, packed, shards > 1);
+  return plan;
+}
+
+// Choose the filter. With a target false positive rate, the plan with the
+// best weighted time among those meeting it (and the memory budget, if any)
+// is picked, the smallest on ties. With a memory budget only, the lowest
+// false positive rate that fits is picked. Throws if no plan qualifies.
+// Only 3-wise binary fuse filters are built, so arity is always 3.
+static inline binary_fuse_plan_t
+binary_fuse_plan(const binary_fuse_plan_request_t &request) {
+  if (request.keys < 2) {
+    throw std::runtime_error("there should be at least 2 keys");
+  }
+  if (request.targetFpr <= 0 && request.memoryBudget == 0) {
+    throw std::runtime_error(
+        "a target false positive rate or a memory budget is needed");
+  }
+  if (request.maxShardKeys < 2) {
+    throw std::runtime_error("shards should hold at least 2 keys");
+  }
+  // Several shards are sized for more keys than the average, and their
+  // capacity decreases with their number until they hold a single key on
+  // average: the fewest shards that fit are found by bisection.
+  uint64_t maxShardKeys = std::min<uint64_t>(
+      request.maxShardKeys, std::numeric_limits<uint32_t>::max());
+  uint64_t minShards = (request.keys + maxShardKeys - 1) / maxShardKeys;
+  uint64_t maxShards =
+      std::min<uint64_t>(request.keys, std::numeric_limits<uint32_t>::max());
+  if (minShards > 1 &&
+      (minShards > maxShards ||
+       binary_fuse_shard_capacity(request.keys, (uint32_t)maxShards) >
+           maxShardKeys)) {
+    throw std::runtime_error("maxShardKeys is too small for these keys");
+  }
+  while (minShards > 1 && minShards < maxShards) {
+    uint64_t middle = minShards + (maxShards - minShards) / 2;
+    if (binary_fuse_shard_capacity(request.keys, (uint32_t)middle) >
+        maxShardKeys) {
+      minShards = middle + 1;
+    } else {
+      maxShards = middle;
+    }
+  }
+  double w = binary_fuse_max(0.0, request.queryWeight);
+  w = w > 1.0 ? 1.0 : w;
+  bool found = false;
+  binary_fuse_plan_t best = {};
+  double bestTime = 0;
+  for (uint32_t bits = 1; bits <= 32; bits++) {
+    // more shards only pay off while they are large, for faster builds
+    for (uint64_t shards = minShards;
+         shards <= std::numeric_limits<uint32_t>::max() &&
+         (shards == minShards || request.keys / shards >= (1 << 16));
+         shards *= 2) {
+      binary_fuse_plan_t plan =
+          binary_fuse_predict(request, bits, (uint32_t)shards);
+      if ((request.targetFpr > 0 && plan.fpr > request.targetFpr) ||
+          (request.memoryBudget > 0 && plan.bytes > request.memoryBudget)) {
+        continue;
+      }
+      double time = w * plan.queryNs +
+                    (1 - w) * plan.buildSeconds * 1e9 / (double)request.keys;
+      bool better;
+      if (!found) {
+        better = true;
+      } else if (request.targetFpr <= 0 && plan.bits != best.bits) {
+        better = plan.bits > best.bits;
+      } else if (time != bestTime) {
+        better = time < bestTime;
+      } else {
+        better = plan.bytes < best.bytes;
+      }
+      if (better) {
+        best = plan;
+        bestTime = time;
+        found = true;
+      }
+    }
+  }
+  if (!found) {
+    throw std::runtime_error("no filter meets the target and the budget");
+  }
+  return best;
+}
+
+template <typename Filter, typename Make>
+std::unique_ptr<binary_fuse_query_t>
+binary_fuse_build_with(const binary_fuse_plan_t &plan,
+                       std::vector<uint64_t> &keys, Make make) {
+  if (plan.shards == 1) {
+    Filter filter = make(std::max<size_t>(2, keys.size()));
+    if (!filter.populate(keys)) {
+      return nullptr;
+    }
+    return std::unique_ptr<binary_fuse_query_t>(
+        new binary_fuse_query_impl_t<Filter>(std::move(filter)));
+  }
+  std::vector<std::vector<uint64_t>> parts(plan.shards);
+  for (uint64_t key : keys) {
+    parts[binary_fuse_shard(key, plan.shards)].push_back(key);
+  }
+  std::vector<Filter> shards;
+  shards.reserve(plan.shards);
+  for (std::vector<uint64_t> &part : parts) {
+    if (part.size() > plan.keysPerShard) {
+      return nullptr; // would not fit in the planned size
+    }
+    shards.push_back(make(std::max<size_t>(2, plan.keysPerShard)));
+    if (!shards.back().populate(part)) {
+      return nullptr;
+    }
+    part = std::vector<uint64_t>();
+  }
+  typedef binary_fuse_sharded_t<Filter> sharded_t;
+  return std::unique_ptr<binary_fuse_query_t>(
+      new binary_fuse_query_impl_t<sharded_t>(sharded_t(std::move(shards))));
+}
+
+// Build the planned filter, returns nullptr if the construction fails (see
+// populate()) or, with overwhelming improbability, if a shard gets more than
+// plan.keysPerShard keys. Shards may remove duplicated keys from their own
+// copy of the keys only.
+static inline std::unique_ptr<binary_fuse_query_t>
+binary_fuse_build(const binary_fuse_plan_t &plan,
+                  std::vector<uint64_t> &keys) {
+  if (keys.size() > std::numeric_limits<uint32_t>::max() * (uint64_t)plan.shards) {
+    throw std::runtime_error("too many keys for the plan");
+  }
+  switch (plan.bits) {
+  case 8:
+    return binary_fuse_build_with<binary_fuse8_t>(
+        plan, keys, [](size_t n) { return binary_fuse8_t((uint32_t)n); });
+  case 16:
+    return binary_fuse_build_with<binary_fuse16_t>(
+        plan, keys, [](size_t n) { return binary_fuse16_t((uint32_t)n); });
+  case 32:
+    return binary_fuse_build_with<binary_fuse32_t>(
+        plan, keys, [](size_t n) { return binary_fuse32_t((uint32_t)n); });
+  default:
+    uint32_t bits = plan.bits;
+    return binary_fuse_build_with<binary_fuse_packed_t>(
+        plan, keys,
+        [bits](size_t n) { return binary_fuse_packed_t((uint32_t)n, bits); });
+  }
+}
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef BINARYFUSEFILTER_PROBE_H
+#define BINARYFUSEFILTER_PROBE_H
+#include "binaryfusefilter.h"
+
+#include <atomic>
+#include <exception>
+#include <thread>
+
+/**
+ * Bulk semi-join probe of a column against a filter, for runtime join
+ * filtering.
+ *
+ * The column holds 64-bit keys, either directly or through a dictionary, and
+ * may have an Arrow-style validity bitmap (bit i of validity[i / 64] is set
+ * when row i is not null); null rows never match. The rows that may be in
+ * the set are returned as a selection vector of row indexes, or as a bitmask.
+ * Rows go through the filter in chunks with contain_batch(), and the
+ * selection vector is compacted without branches; a filter that has
+ * select_batch() (binary_fuse_t) does both in a single pass over the plain
+ * columns. Large columns are split in morsels processed by a pool of threads.
+ *
+ * Any filter with contain_batch() works: binary_fuse_t, binary_fuse_paged_t,
+ * binary_fuse_query_t, xor_filter_t...
+ ***/
+
+struct binary_fuse_column_t {
+  const uint64_t *values = nullptr;   // the keys, or the dictionary
+  const uint64_t *validity = nullptr; // nullptr when there is no null
+  const uint32_t *indices = nullptr;  // dictionary codes, or nullptr
+  size_t dictionarySize = 0;
+  size_t length = 0; // number of rows
+};
+
+// rows per morsel, a multiple of 64 so that threads write distinct words of
+// a bitmask
+#define BINARY_FUSE_PROBE_MORSEL 65536
+// rows per contain_batch() call
+#define BINARY_FUSE_PROBE_CHUNK 1024
+
+// whether Filter has select_batch(keys, n, first, selection)
+template <typename Filter, typename = void>
+struct binary_fuse_has_select_batch : std::false_type {};
+
+template <typename Filter>
+struct binary_fuse_has_select_batch<
+    Filter, std::void_t<decltype(std::declval<const Filter &>().select_batch(
+                (const uint64_t *)nullptr, (size_t)0, (uint32_t)0,
+                (uint32_t *)nullptr))>> : std::true_type {};
+
+// Set match[0, end - begin) for the rows [begin, end) of the column.
+// dictionaryMatch holds the answer for each dictionary entry.
+template <typename Filter>
+static inline void binary_fuse_probe_chunk(const Filter &filter,
+                                           const binary_fuse_column_t &column,
+                                           const bool *dictionaryMatch,
+                                           size_t begin, size_t end,
+                                           bool *match) {
+  size_t n = end - begin;
+  if (column.indices == nullptr) {
+    filter.contain_batch(column.values + begin, n, match);
+    if (column.validity != nullptr) {
+      for (size_t i = 0; i < n; i++) {
+        size_t row = begin + i;
+        match[i] &= (bool)((column.validity[row / 64] >> (row % 64)) & 1);
+      }
+    }
+  } else if (column.validity == nullptr) {
+    const uint32_t *indices = column.indices + begin;
+    for (size_t i = 0; i < n; i++) {
+      match[i] = dictionaryMatch[indices[i]];
+    }
+  } else {
+    // the codes of null rows are undefined: they read entry 0 instead
+    const uint32_t *indices = column.indices + begin;
+    for (size_t i = 0; i < n; i++) {
+      size_t row = begin + i;
+      uint32_t valid = (uint32_t)(column.validity[row / 64] >> (row % 64)) & 1;
+      match[i] = dictionaryMatch[indices[i] & (0 - valid)] & (bool)valid;
+    }
+  }
+}
+
+// Run morsel(begin, end) over the rows of the column with 'threads' threads.
+template <typename Morsel>
+static inline void binary_fuse_probe_morsels(size_t length, unsigned threads,
+                                             Morsel morsel) {
+  size_t morsels =
+      (length + BINARY_FUSE_PROBE_MORSEL - 1) / BINARY_FUSE_PROBE_MORSEL;
+  if (threads <= 1 || morsels <= 1) {
+    for (size_t m = 0; m < morsels; m++) {
+      size_t begin = m * BINARY_FUSE_PROBE_MORSEL;
+      morsel(begin, std::min<size_t>(length, begin + BINARY_FUSE_PROBE_MORSEL));
+    }
+    return;
+  }
+  std::atomic<size_t> next(0);
+  std::exception_ptr error;
+  std::atomic<bool> failed(false);
+  auto work = [&]() {
+    try {
+      for (size_t m = next++; m < morsels && !failed; m = next++) {
+        size_t begin = m * BINARY_FUSE_PROBE_MORSEL;
+        morsel(begin,
+               std::min<size_t>(length, begin + BINARY_FUSE_PROBE_MORSEL));
+      }
+    } catch (...) {
+      if (!failed.exchange(true)) {
+        error = std::current_exception();
+      }
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned t = 1; t < std::min<size_t>(threads, morsels); t++) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (std::thread &t : pool) {
+    t.join();
+  }
+  if (error) {
+    std::rethrow_exception(error);
+  }
+}
+
+template <typename Filter>
+static inline std::unique_ptr<bool[]>
+binary_fuse_probe_dictionary(const Filter &filter,
+                             const binary_fuse_column_t &column) {
+  if (column.indices == nullptr) {
+    return nullptr;
+  }
+  // entry 0 exists even for an empty dictionary, as null rows read it
+  std::unique_ptr<bool[]> match(
+      new bool[std::max<size_t>(1, column.dictionarySize)]());
+  filter.contain_batch(column.values, column.dictionarySize, match.get());
+  return match;
+}
+
+// Write to selection (room for column.length entries) the indexes of the
+// rows that may be in the set, in increasing order. Returns their number.
+template <typename Filter>
+size_t binary_fuse_probe(const Filter &filter,
+                         const binary_fuse_column_t &column,
+                         uint32_t *selection, unsigned threads = 1) {
+  if (column.length > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("columns should have at most 2^32 rows");
+  }
+  std::unique_ptr<bool[]> dictionaryMatch =
+      binary_fuse_probe_dictionary(filter, column);
+  size_t morsels =
+      (column.length + BINARY_FUSE_PROBE_MORSEL - 1) / BINARY_FUSE_PROBE_MORSEL;
+  std::vector<uint32_t> counts(morsels);
+  // each morsel compacts its rows at the start of its own slice of selection
+  binary_fuse_probe_morsels(column.length, threads, [&](size_t begin,
+                                                        size_t end) {
+    bool match[BINARY_FUSE_PROBE_CHUNK];
+    uint32_t *out = selection + begin;
+    size_t count = 0;
+    if constexpr (binary_fuse_has_select_batch<Filter>::value) {
+      if (column.indices == nullptr && column.validity == nullptr) {
+        count = filter.select_batch(column.values + begin, end - begin,
+                                    (uint32_t)begin, out);
+        counts[begin / BINARY_FUSE_PROBE_MORSEL] = (uint32_t)count;
+        return;
+      }
+    }
+    for (size_t chunk = begin; chunk < end; chunk += BINARY_FUSE_PROBE_CHUNK) {
+      size_t chunkEnd = std::min<size_t>(end, chunk + BINARY_FUSE_PROBE_CHUNK);
+      binary_fuse_probe_chunk(filter, column, dictionaryMatch.get(), chunk,
+                              chunkEnd, match);
+      for (size_t i = 0; i < chunkEnd - chunk; i++) {
+        out[count] = (uint32_t)(chunk + i);
+        count += match[i];
+      }
+    }
+    counts[begin / BINARY_FUSE_PROBE_MORSEL] = (uint32_t)count;
+  });
+  size_t total = 0;
+  for (size_t m = 0; m < morsels; m++) {
+    if (total != m * BINARY_FUSE_PROBE_MORSEL) {
+      memmove(selection + total, selection + m * BINARY_FUSE_PROBE_MORSEL,
+              counts[m] * sizeof(uint32_t));
+    }
+    total += counts[m];
+  }
+  return total;
+}
+
+// Set bit i of bitmask[i / 64] when row i may be in the set, the other bits
+// being cleared. bitmask must hold (column.length + 63) / 64 words.
+template <typename Filter>
+void binary_fuse_probe_bitmask(const Filter &filter,
+                               const binary_fuse_column_t &column,
+                               uint64_t *bitmask, unsigned threads = 1) {
+  std::unique_ptr<bool[]> dictionaryMatch =
+      binary_fuse_probe_dictionary(filter, column);
+  binary_fuse_probe_morsels(column.length, threads, [&](size_t begin,
+                                                        size_t end) {
+    bool match[BINARY_FUSE_PROBE_CHUNK];
+    for (size_t chunk = begin; chunk < end; chunk += BINARY_FUSE_PROBE_CHUNK) {
+      size_t chunkEnd = std::min<size_t>(end, chunk + BINARY_FUSE_PROBE_CHUNK);
+      binary_fuse_probe_chunk(filter, column, dictionaryMatch.get(), chunk,
+                              chunkEnd, match);
+      for (size_t word = 0; word * 64 < chunkEnd - chunk; word++) {
+        uint64_t bits = 0;
+        size_t rows = std::min<size_t>(64, chunkEnd - chunk - word * 64);
+        for (size_t j = 0; j < rows; j++) {
+          bits |= (uint64_t)match[word * 64 + j] << j;
+        }
+        bitmask[chunk / 64 + word] = bits;
+      }
+    }
+  });
+}
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef XORFILTER_H
+#define XORFILTER_H
+#include "binaryfusefilter.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/**
+ * Xor filters: the three positions of a key are spread over three blocks of
+ * equal length, about 1.23 fingerprints per key in total. They are built by
+ * the peeling engine of binary_fuse_t (binary_fuse_peel) and share its query
+ * API, contain() and contain_batch(), so that they fit wherever a binary fuse
+ * filter does (binary_fuse_query_impl_t, binary_fuse_instrumented_t,
+ * binary_fuse_probe...).
+ *
+ * xor_plus_filter_t is the Xor+ variant: the same fingerprints, but the zeros
+ * of the second and third blocks are not stored. A bitmap with a rank index
+ * locates the others, which makes it smaller than xor_filter_t (by about 4%
+ * with 8-bit fingerprints, 9% with 16-bit ones) at the cost of slower
+ * queries.
+ ***/
+
+static inline uint32_t xor_popcount64(uint64_t x) {
+// without a popcount instruction, the builtin is a call to a table-based
+// routine, slower than the bit twiddling below
+#if (defined(__GNUC__) || defined(__clang__)) &&                              \
+    (defined(__POPCNT__) || defined(__aarch64__))
+  return (uint32_t)__builtin_popcountll(x);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+  return (uint32_t)__popcnt64(x);
+#else
+  x = x - ((x >> 1) & UINT64_C(0x5555555555555555));
+  x = (x & UINT64_C(0x3333333333333333)) +
+      ((x >> 2) & UINT64_C(0x3333333333333333));
+  x = (x + (x >> 4)) & UINT64_C(0x0f0f0f0f0f0f0f0f);
+  return (uint32_t)((x * UINT64_C(0x0101010101010101)) >> 56);
+#endif
+}
+
+// The shape of a xor filter, the counterpart of binary_fuse_layout_t
+struct xor_filter_layout_t {
+  uint32_t blockLength;
+  uint32_t arrayLength;
+
+  void positions(uint64_t hash, uint32_t h[3]) const {
+    h[0] = binary_fuse_reduce((uint32_t)hash, blockLength);
+    h[1] = binary_fuse_reduce((uint32_t)binary_fuse_rotl64(hash, 21),
+                              blockLength) +
+           blockLength;
+    h[2] = binary_fuse_reduce((uint32_t)binary_fuse_rotl64(hash, 42),
+                              blockLength) +
+           2 * blockLength;
+  }
+};
+
+// shape of a xor filter for 'size' keys
+static inline xor_filter_layout_t xor_filter_calculate_layout(uint32_t size) {
+  if ((uint64_t)(32 + 1.23 * size) > std::numeric_limits<uint32_t>::max()) {
+    throw std::runtime_error("size is too large for a xor filter");
+  }
+  uint32_t capacity = (uint32_t)(32 + 1.23 * size);
+  xor_filter_layout_t l;
+  l.blockLength = capacity / 3;
+  l.arrayLength = 3 * l.blockLength;
+  return l;
+}
+
+//////////////////
+// xorT
+//////////////////
+
+template <typename T,
+          class = typename std::enable_if_t<std::is_unsigned<T>::value>>
+class xor_filter_t {
+private:
+  uint64_t _seed;
+  xor_filter_layout_t _layout;
+  std::vector<T> _fingerprints;
+
+public:
+  typedef T fingerprint_t;
+
+  static constexpr uint64_t default_rng_seed =
+      binary_fuse_t<T>::default_rng_seed;
+
+  // allocate enough capacity for a set containing up to 'size' elements
+  explicit xor_filter_t(uint32_t size)
+      : _seed(0), _layout(xor_filter_calculate_layout(size)),
+        _fingerprints(_layout.arrayLength) {}
+
+  // Report if the key is in the set, with false positive rate.
+  bool contain(uint64_t key) const {
+    uint64_t hash = binary_fuse_mix_split(key, _seed);
+    T f = binary_fuse_fingerprint(hash);
+    uint32_t h[3];
+    _layout.positions(hash, h);
+    f ^= _fingerprints[h[0]] ^ _fingerprints[h[1]] ^ _fingerprints[h[2]];
+    return f == 0;
+  }
+
+  // out[i] = contain(keys[i]) for i in [0, n)
+  void contain_batch(const uint64_t *keys, size_t n, bool *out) const {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = contain(keys[i]);
+    }
+  }
+
+  uint64_t seed() const { return _seed; }
+
+  const std::vector<T> &fingerprints() const { return _fingerprints; }
+
+  xor_filter_layout_t layout() const { return _layout; }
+
+  // report memory usage
+  size_t size_in_bytes() const {
+    return _layout.arrayLength * sizeof(T) + sizeof(*this);
+  }
+
+  // Construct the filter, returns true on success, false on failure. Same
+  // contract as binary_fuse_t::populate(): keys will be sorted and duplicates
+  // removed if any duplicate keys exist, and the same keys and rng_seed always
+  // produce the same filter.
+  [[nodiscard]] bool populate(std::vector<uint64_t> &keys,
+                              uint64_t rng_seed = default_rng_seed) {
+    if (keys.size() > std::numeric_limits<uint32_t>::max()) {
+      throw std::runtime_error("size should be at most 2^32");
+    }
+    uint32_t size = (uint32_t)keys.size();
+    uint64_t rng_counter = rng_seed;
+    uint64_t seed = binary_fuse_rng_splitmix64(&rng_counter);
+    // the blocks have no locality to preserve: the hashes stay in key order
+    auto fill = [&](uint64_t attemptSeed, uint32_t n, uint64_t *reverseOrder) {
+      for (uint32_t i = 0; i < n; i++) {
+        reverseOrder[i] = binary_fuse_mix_split(keys[i], attemptSeed);
+      }
+    };
+    auto dedupe = [&]() {
+      std::sort(keys.begin(), keys.end());
+      keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+      return (uint32_t)keys.size();
+    };
+    std::vector<uint64_t> reverseOrder;
+    std::vector<uint8_t> reverseH;
+    if (!binary_fuse_peel(_layout, size, seed, rng_counter, fill, dedupe,
+                          reverseOrder, reverseH)) {
+      return false;
+    }
+    _seed = seed;
+    std::fill(_fingerprints.begin(), _fingerprints.end(), 0);
+    binary_fuse_assign(_layout, _fingerprints.data(), reverseOrder.data(),
+                       reverseH.data(), size);
+    return true;
+  }
+};
+
+// False postive rate: 1/256
+// Approximate bits per entry: 9.84
+typedef xor_filter_t<uint8_t> xor_filter8_t;
+
+// False postive rate: 1/65536
+// Approximate bits per entry: 19.7
+typedef xor_filter_t<uint16_t> xor_filter16_t;
+
+// False postive rate: 1 / 4 billion
+// Approximate bits per entry: 39.4
+typedef xor_filter_t<uint32_t> xor_filter32_t;
+
+//////////////////
+// xorplusT
+//////////////////
+
+template <typename T,
+          class = typename std::enable_if_t<std::is_unsigned<T>::value>>
+class xor_plus_filter_t {
+private:
+  uint64_t _seed;
+  uint32_t _size;
+  xor_filter_layout_t _layout;
+  // the first block, then the non-zero fingerprints of the two others and a
+  // trailing zero
+  std::vector<T> _fingerprints;
+  // Bit i is set when the fingerprint i of the last two blocks is not zero.
+  // Every 256 bits come after a word of rank: its low 32 bits count the bits
+  // set before them, and its byte 4 + j those set in their first j words.
+  std::vector<uint64_t> _bits;
+
+  // fingerprint i of the last two blocks
+  T rest(uint32_t i) const {
+    const uint64_t *group = _bits.data() + 5 * (size_t)(i / 256);
+    uint32_t j = (i / 64) % 4;
+    uint64_t word = group[1 + j];
+    uint64_t bit = UINT64_C(1) << (i % 64);
+    uint32_t rank = (uint32_t)group[0] +
+                    (uint32_t)((group[0] >> (32 + 8 * j)) & 0xff) +
+                    xor_popcount64(word & (bit - 1));
+    // without the bit, this reads the next stored fingerprint (or the
+    // trailing zero), which is discarded
+    T f = _fingerprints[_layout.blockLength + rank];
+    return (word & bit) ? f : 0;
+  }
+
+public:
+  typedef T fingerprint_t;
+
+  static constexpr uint64_t default_rng_seed =
+      xor_filter_t<T>::default_rng_seed;
+
+  // allocate enough capacity for a set containing up to 'size' elements
+  explicit xor_plus_filter_t(uint32_t size)
+      : _seed(0), _size(size), _layout(xor_filter_calculate_layout(size)),
+        _fingerprints(_layout.blockLength + 1),
+        _bits(5 * ((2 * (size_t)_layout.blockLength + 255) / 256)) {}
+
+  // Report if the key is in the set, with false positive rate.
+  bool contain(uint64_t key) const {
+    uint64_t hash = binary_fuse_mix_split(key, _seed);
+    T f = binary_fuse_fingerprint(hash);
+    uint32_t h[3];
+    _layout.positions(hash, h);
+    f ^= _fingerprints[h[0]] ^ rest(h[1] - _layout.blockLength) ^
+         rest(h[2] - _layout.blockLength);
+    return f == 0;
+  }
+
+  // out[i] = contain(keys[i]) for i in [0, n)
+  void contain_batch(const uint64_t *keys, size_t n, bool *out) const {
+    for (size_t i = 0; i < n; i++) {
+      out[i] = contain(keys[i]);
+    }
+  }
+
+  uint64_t seed() const { return _seed; }
+
+  // report memory usage
+  size_t size_in_bytes() const {
+    return _fingerprints.size() * sizeof(T) +
+           _bits.size() * sizeof(uint64_t) + sizeof(*this);
+  }
+
+  // Construct the filter, returns true on success, false on failure. It goes
+  // through a xor_filter_t, which it answers exactly like.
+  [[nodiscard]] bool populate(std::vector<uint64_t> &keys,
+                              uint64_t rng_seed = default_rng_seed) {
+    xor_filter_t<T> filter(_size);
+    if (!filter.populate(keys, rng_seed)) {
+      return false;
+    }
+    const std::vector<T> &f = filter.fingerprints();
+    uint32_t blockLength = _layout.blockLength;
+    size_t restLength = 2 * (size_t)blockLength;
+    _bits.assign(5 * ((restLength + 255) / 256), 0);
+    _fingerprints.assign(f.begin(), f.begin() + blockLength);
+    for (size_t i = 0; i < restLength; i++) {
+      uint64_t *group = _bits.data() + 5 * (i / 256);
+      uint32_t stored = (uint32_t)(_fingerprints.size() - blockLength);
+      if (i % 256 == 0) {
+        group[0] = stored;
+      } else if (i % 64 == 0) {
+        uint64_t inGroup = stored - (uint32_t)group[0];
+        group[0] |= inGroup << (32 + 8 * ((i / 64) % 4));
+      }
+      T v = f[blockLength + i];
+      if (v != 0) {
+        group[1 + (i / 64) % 4] |= UINT64_C(1) << (i % 64);
+        _fingerprints.push_back(v);
+      }
+    }
+    _fingerprints.push_back(0);
+    _fingerprints.shrink_to_fit();
+    _seed = filter.seed();
+    return true;
+  }
+};
+
+// False postive rate: 1/256
+// Approximate bits per entry: 9.44
+typedef xor_plus_filter_t<uint8_t> xor_plus_filter8_t;
+
+// False postive rate: 1/65536
+// Approximate bits per entry: 17.9
+typedef xor_plus_filter_t<uint16_t> xor_plus_filter16_t;
+
+#endif
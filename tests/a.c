@@ -1,6 +1,26 @@
+#define BINARY_FUSE_INSTRUMENTATION
 #include "binaryfusefilter.h"
+#include "binaryfusefilter_instrumented.h"
+#include <numeric>
 #include <stdlib.h>
 
+// in b.c, built without BINARY_FUSE_INSTRUMENTATION
+uint64_t b_instrumented_queries(const binary_fuse8_t &filter, uint64_t key);
+
 int main() {
+    std::vector<uint64_t> keys(1000);
+    std::iota(keys.begin(), keys.end(), 0);
+    binary_fuse8_t filter(1000);
+    if (!filter.populate(keys)) {
+        return EXIT_FAILURE;
+    }
+    typedef binary_fuse_instrumented_t<binary_fuse8_t,
+                                       BINARY_FUSE_INSTRUMENTATION_ENABLED>
+        instrumented_t;
+    instrumented_t instrumented(filter);
+    if (!instrumented.contain(1) || instrumented.stats().queries != 1 ||
+        b_instrumented_queries(filter, 1) != 0) {
+        return EXIT_FAILURE;
+    }
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -1 +1,13 @@
-#include "binaryfusefilter.h"
\ No newline at end of file
+#include "binaryfusefilter.h"
+#include "binaryfusefilter_instrumented.h"
+
+uint64_t b_instrumented_queries(const binary_fuse8_t &filter, uint64_t key) {
+    typedef binary_fuse_instrumented_t<binary_fuse8_t,
+                                       BINARY_FUSE_INSTRUMENTATION_ENABLED>
+        instrumented_t;
+    instrumented_t instrumented(filter);
+    if (!instrumented.contain(key)) {
+        return UINT64_MAX;
+    }
+    return instrumented.stats().queries;
+}
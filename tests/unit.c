@@ -1,7 +1,14 @@
 #include "binaryfusefilter.h"
+#include "binaryfusefilter_distributed.h"
+#include "binaryfusefilter_instrumented.h"
+#include "binaryfusefilter_paged.h"
+#include "binaryfusefilter_planner.h"
+#include "binaryfusefilter_probe.h"
+#include "xorfilter.h"
 #include <assert.h>
 #include <climits>
 #include <numeric>
+#include <thread>
 
 
 bool testbinaryfuse8(size_t size) {
@@ -260,6 +267,407 @@ bool testbinaryfuse32_dup(size_t size) {
 
 
 
+bool testbinaryfuse16_paged(size_t size) {
+  printf("testing paged binary fuse16\n");
+  binary_fuse16_t filter(size);
+
+  // Allocate vector of contiguous values [0, 1, 2, ..., size-1]
+  std::vector<uint64_t> big_set(size);
+  std::iota(big_set.begin(), big_set.end(), 0);
+
+  // we construct the filter
+  if(!filter.populate(big_set)) { printf("failure to populate\n"); return false; }
+
+  char path[] = "/tmp/binaryfuseXXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) { printf("cannot create a temporary file\n"); return false; }
+  close(fd);
+  if (!binary_fuse_save(filter, path)) { printf("failure to save\n"); return false; }
+
+  // a small cache, so that pages get evicted
+  auto cache = std::make_shared<binary_fuse_page_cache_t>(4096, 8);
+  bool ok = true;
+  {
+    binary_fuse16_paged_t paged(path, cache);
+    for (size_t i = 0; i < size; i++) {
+      if (!paged.contain(big_set[i])) {
+        printf("bug!\n");
+        ok = false;
+        break;
+      }
+    }
+
+    size_t trials = 100000;
+    std::vector<uint64_t> queries(trials);
+    for (size_t i = 0; i < trials; i++) {
+      queries[i] = ((uint64_t)rand() << 32) + rand();
+    }
+    std::unique_ptr<bool[]> answers(new bool[trials]);
+    paged.contain_batch_async(queries.data(), trials, answers.get()).get();
+    for (size_t i = 0; ok && i < trials; i++) {
+      if (answers[i] != filter.contain(queries[i])) {
+        printf("bug in batch!\n");
+        ok = false;
+      }
+    }
+    binary_fuse_page_cache_t::stats_t stats = cache->stats();
+    printf(" page hits %llu misses %llu evictions %llu\n",
+           (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+           (unsigned long long)stats.evictions);
+    size_t pages = (paged.array_length() * sizeof(uint16_t) + 4095) / 4096;
+    if (pages > cache->capacity() && stats.evictions == 0) {
+      printf("expected evictions\n");
+      ok = false;
+    }
+  }
+  remove(path);
+  return ok;
+}
+
+// the multi-process build of big_set matches populate()
+bool multiprocess_matches(size_t size, const std::vector<uint64_t> &big_set,
+                          uint64_t rng_seed) {
+  binary_fuse8_t filter(size);
+  std::vector<uint64_t> keys(big_set);
+  if(!filter.populate(keys, rng_seed)) { printf("failure to populate\n"); return false; }
+  std::vector<char> expected(filter.serialization_bytes());
+  filter.serialize(expected.data());
+
+  for (uint32_t workers = 1; workers <= 4; workers *= 2) {
+    binary_fuse8_t other(size);
+    if (!binary_fuse_multiprocess_populate(other, big_set, workers, rng_seed)) {
+      printf("failure to populate with %u workers\n", workers);
+      return false;
+    }
+    std::vector<char> actual(other.serialization_bytes());
+    other.serialize(actual.data());
+    if (actual != expected) {
+      printf("bug: %u workers do not match populate()\n", workers);
+      return false;
+    }
+  }
+  for (size_t i = 0; i < big_set.size(); i++) {
+    if (!filter.contain(big_set[i])) {
+      printf("bug!\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+bool testbinaryfuse8_multiprocess(size_t size) {
+  printf("testing multi-process binary fuse8\n");
+  std::vector<uint64_t> big_set(size);
+  for (size_t i = 0; i < size; i++) {
+    big_set[i] = rand() + (((uint64_t) rand()) << 32);
+  }
+  if (!multiprocess_matches(size, big_set, binary_fuse8_t::default_rng_seed)) {
+    return false;
+  }
+  // duplicates must be handled the same way: a single one, then 10% of them
+  for (uint64_t rng_seed = 1; rng_seed <= 10; rng_seed++) {
+    std::vector<uint64_t> keys(big_set);
+    keys[size / 2] = keys[size / 3 + rng_seed];
+    if (!multiprocess_matches(size, keys, rng_seed)) {
+      printf("with one duplicate\n");
+      return false;
+    }
+    for (size_t i = 0; i < size / 10; i++) {
+      keys[size - 1 - i] = keys[i];
+    }
+    if (!multiprocess_matches(size, keys, rng_seed)) {
+      printf("with 10%% duplicates\n");
+      return false;
+    }
+  }
+  // writing to a dead worker throws instead of raising SIGPIPE
+  int fds[2];
+  if (pipe(fds) != 0) { return false; }
+  close(fds[0]);
+  bool thrown = false;
+  {
+    binary_fuse_sigpipe_guard_t guard;
+    try {
+      binary_fuse_send<uint8_t>(fds[1], BINARY_FUSE_CMD_EXIT);
+    } catch (const std::runtime_error &) {
+      thrown = true;
+    }
+  }
+  close(fds[1]);
+  return thrown;
+}
+
+bool testbinaryfuse8_instrumented(size_t size) {
+  printf("testing instrumented binary fuse8\n");
+  binary_fuse8_t filter(size);
+
+  // Allocate vector of contiguous values [0, 1, 2, ..., size-1]
+  std::vector<uint64_t> big_set(size);
+  std::iota(big_set.begin(), big_set.end(), 0);
+
+  // we construct the filter
+  if(!filter.populate(big_set)) { printf("failure to populate\n"); return false; }
+
+  binary_fuse_instrumented_t<binary_fuse8_t, true> instrumented(filter, 16);
+  std::unique_ptr<bool[]> answers(new bool[size]);
+  instrumented.contain_batch(big_set.data(), size, answers.get());
+  for (size_t i = 0; i < size; i++) {
+    if (!answers[i]) {
+      printf("bug!\n");
+      return false;
+    }
+    instrumented.report(true);
+  }
+
+  // random queries from two threads, the outcomes being reported
+  size_t trials = 1000000;
+  auto query = [&instrumented, size, trials](uint64_t seed) {
+    std::function<void(bool)> reporter = instrumented.reporter();
+    for (size_t i = 0; i < trials; i++) {
+      uint64_t random_key = binary_fuse_rng_splitmix64(&seed);
+      if (instrumented.contain(random_key)) {
+        reporter(random_key < size);
+      }
+    }
+  };
+  std::thread other(query, 1234);
+  query(5678);
+  other.join();
+
+  binary_fuse_query_stats_t stats = instrumented.stats();
+  uint64_t timed = 0;
+  for (size_t i = 0; i < BINARY_FUSE_LATENCY_BUCKETS; i++) {
+    timed += stats.latency[i];
+  }
+  printf(" queries %llu positives %llu timed %llu\n",
+         (unsigned long long)stats.queries, (unsigned long long)stats.positives,
+         (unsigned long long)timed);
+  printf(" fpp %3.5f (live estimate) %3.5f (theoretical)\n",
+         stats.estimated_fpr(), instrumented.theoretical_fpr());
+  if (stats.queries != size + 2 * trials ||
+      stats.true_positives + stats.false_positives != stats.positives ||
+      timed != 1 + 2 * trials / 16) {
+    printf("bug in the counters!\n");
+    return false;
+  }
+  double ratio = stats.estimated_fpr() / instrumented.theoretical_fpr();
+  if (ratio < 0.5 || ratio > 2.0) {
+    printf("unexpected false positive rate\n");
+    return false;
+  }
+
+  // the sampling counts calls, not keys
+  binary_fuse_instrumented_t<binary_fuse8_t, true> sampled(filter, 2);
+  for (int i = 0; i < 3; i++) {
+    sampled.contain_batch(big_set.data(), size, answers.get());
+  }
+  stats = sampled.stats();
+  timed = 0;
+  for (size_t i = 0; i < BINARY_FUSE_LATENCY_BUCKETS; i++) {
+    timed += stats.latency[i];
+  }
+  if (stats.queries != 3 * size || timed != 2) {
+    printf("bug in the latency sampling!\n");
+    return false;
+  }
+
+  // a thread going through many wrappers in turn keeps its counters apart
+  std::vector<std::unique_ptr<binary_fuse_instrumented_t<binary_fuse8_t, true>>>
+      many;
+  for (size_t w = 0; w < 300; w++) {
+    many.emplace_back(
+        new binary_fuse_instrumented_t<binary_fuse8_t, true>(filter));
+  }
+  for (size_t i = 0; i < 3; i++) {
+    for (size_t w = 0; w < many.size(); w++) {
+      many[w]->contain_batch(big_set.data(), w % 7, answers.get());
+    }
+  }
+  for (size_t w = 0; w < many.size(); w++) {
+    if (many[w]->stats().queries != 3 * (w % 7)) {
+      printf("bug in the thread cache!\n");
+      return false;
+    }
+  }
+
+  // turned off, the wrapper only forwards
+  binary_fuse_instrumented_t<binary_fuse8_t, false> disabled(filter);
+  disabled.contain_batch(big_set.data(), size, answers.get());
+  for (size_t i = 0; i < size; i++) {
+    if (!answers[i] || !disabled.contain(big_set[i])) {
+      printf("bug!\n");
+      return false;
+    }
+    disabled.report(true);
+  }
+  stats = disabled.stats();
+  if (stats.queries != 0 || stats.positives != 0 || stats.true_positives != 0 ||
+      sizeof(disabled) != sizeof(&filter)) {
+    printf("the disabled wrapper records\n");
+    return false;
+  }
+  return true;
+}
+
+bool testbinaryfuse_planned(size_t size, double target_fpr,
+                            uint64_t memory_budget, uint64_t max_shard_keys) {
+  printf("testing planned binary fuse\n");
+  binary_fuse_plan_request_t request;
+  request.keys = size;
+  request.targetFpr = target_fpr;
+  request.memoryBudget = memory_budget;
+  request.maxShardKeys = max_shard_keys;
+  binary_fuse_plan_t plan = binary_fuse_plan(request);
+  printf(" plan: %u bits, arity %u, %u shards, %llu bytes, fpp %3.5f\n",
+         plan.bits, plan.arity, plan.shards, (unsigned long long)plan.bytes,
+         plan.fpr);
+  if ((target_fpr > 0 && plan.fpr > target_fpr) ||
+      (memory_budget > 0 && plan.bytes > memory_budget) ||
+      (uint64_t)plan.shards * max_shard_keys < size) {
+    printf("bug in the plan!\n");
+    return false;
+  }
+
+  // Allocate vector of contiguous values [0, 1, 2, ..., size-1]
+  std::vector<uint64_t> big_set(size);
+  std::iota(big_set.begin(), big_set.end(), 0);
+  std::unique_ptr<binary_fuse_query_t> filter = binary_fuse_build(plan, big_set);
+  if (!filter) { printf("failure to populate\n"); return false; }
+
+  std::unique_ptr<bool[]> answers(new bool[size]);
+  filter->contain_batch(big_set.data(), size, answers.get());
+  for (size_t i = 0; i < size; i++) {
+    if (!answers[i] || !filter->contain(big_set[i])) {
+      printf("bug!\n");
+      return false;
+    }
+  }
+
+  size_t random_matches = 0;
+  size_t trials = 1000000;
+  for (size_t i = 0; i < trials; i++) {
+    uint64_t random_key = ((uint64_t)rand() << 32) + rand();
+    if (filter->contain(random_key)) {
+      if (random_key >= size) {
+        random_matches++;
+      }
+    }
+  }
+  double fpp = random_matches * 1.0 / trials;
+  printf(" fpp %3.5f (estimated) \n", fpp);
+  printf(" bytes %zu (predicted %llu)\n", filter->size_in_bytes(),
+         (unsigned long long)plan.bytes);
+  if (fpp > 2 * plan.fpr + 0.0001 || filter->size_in_bytes() != plan.bytes ||
+      (memory_budget > 0 && filter->size_in_bytes() > memory_budget)) {
+    printf("the filter does not match the plan\n");
+    return false;
+  }
+
+  // shards that small cannot hold their share of the keys with any margin
+  request.targetFpr = 0.01;
+  request.memoryBudget = 0;
+  request.maxShardKeys = 5;
+  bool thrown = false;
+  try {
+    binary_fuse_plan(request);
+  } catch (const std::runtime_error &) {
+    thrown = true;
+  }
+  request.maxShardKeys = 64;
+  plan = binary_fuse_plan(request);
+  if (!thrown || plan.keysPerShard > 64) {
+    printf("bug in the plan with small shards!\n");
+    return false;
+  }
+  return true;
+}
+
+bool testbinaryfuse8_probe(size_t size) {
+  printf("testing binary fuse8 probe\n");
+  binary_fuse8_t filter(size);
+
+  // Allocate vector of contiguous values [0, 1, 2, ..., size-1]
+  std::vector<uint64_t> big_set(size);
+  std::iota(big_set.begin(), big_set.end(), 0);
+
+  // we construct the filter
+  if(!filter.populate(big_set)) { printf("failure to populate\n"); return false; }
+
+  // a column of members and random keys, with nulls, and its dictionary
+  // encoded version
+  size_t rows = 3 * size + 17;
+  std::vector<uint64_t> values(rows), validity((rows + 63) / 64);
+  std::vector<uint32_t> indices(rows);
+  std::vector<uint64_t> dictionary(size + 1000);
+  for (size_t i = 0; i < dictionary.size(); i++) {
+    dictionary[i] = (i < size) ? i : ((uint64_t)rand() << 32) + rand();
+  }
+  for (size_t i = 0; i < rows; i++) {
+    indices[i] = rand() % dictionary.size();
+    values[i] = dictionary[indices[i]];
+    if (rand() % 10 != 0) {
+      validity[i / 64] |= UINT64_C(1) << (i % 64);
+    } else {
+      // the code of a null row is undefined, and may be out of range
+      indices[i] = 0xdeadbeef;
+    }
+  }
+  binary_fuse_column_t plain;
+  plain.values = values.data();
+  plain.validity = validity.data();
+  plain.length = rows;
+  binary_fuse_column_t encoded;
+  encoded.values = dictionary.data();
+  encoded.dictionarySize = dictionary.size();
+  encoded.indices = indices.data();
+  encoded.validity = validity.data();
+  encoded.length = rows;
+
+  std::vector<uint32_t> expected;
+  for (size_t i = 0; i < rows; i++) {
+    if (((validity[i / 64] >> (i % 64)) & 1) && filter.contain(values[i])) {
+      expected.push_back(i);
+    }
+  }
+  for (unsigned threads = 1; threads <= 4; threads *= 4) {
+    for (const binary_fuse_column_t *column : {&plain, &encoded}) {
+      std::vector<uint32_t> selection(rows);
+      size_t count = binary_fuse_probe(filter, *column, selection.data(), threads);
+      selection.resize(count);
+      std::vector<uint64_t> bitmask((rows + 63) / 64, ~UINT64_C(0));
+      binary_fuse_probe_bitmask(filter, *column, bitmask.data(), threads);
+      std::vector<uint32_t> fromBitmask;
+      for (size_t i = 0; i < rows; i++) {
+        if ((bitmask[i / 64] >> (i % 64)) & 1) {
+          fromBitmask.push_back(i);
+        }
+      }
+      if (selection != expected || fromBitmask != expected) {
+        printf("bug!\n");
+        return false;
+      }
+    }
+  }
+
+  // without nulls, the rows go through select_batch()
+  plain.validity = nullptr;
+  expected.clear();
+  for (size_t i = 0; i < rows; i++) {
+    if (filter.contain(values[i])) {
+      expected.push_back(i);
+    }
+  }
+  std::vector<uint32_t> selection(rows);
+  size_t count = binary_fuse_probe(filter, plain, selection.data());
+  selection.resize(count);
+  if (selection != expected) {
+    printf("bug!\n");
+    return false;
+  }
+  printf(" %zu rows selected out of %zu\n", expected.size(), rows);
+  return true;
+}
+
 void failure_rate_binary_fuse16() {
   printf("testing binary fuse16 for failure rate\n");
   // we construct many 5000-long input cases and check the probability of failure.
@@ -285,6 +693,143 @@ void failure_rate_binary_fuse16() {
   printf("failures %zu out of %zu\n\n", failure, total_trials);
 }
 
+bool testbinaryfuse16_hashes(size_t size) {
+  printf("testing binary fuse16 built from hashes with size %zu\n", size);
+  uint64_t rng = 42;
+  std::vector<uint64_t> hashes(size);
+  for (size_t i = 0; i < size; i++) {
+    hashes[i] = binary_fuse_rng_splitmix64(&rng);
+  }
+  // a few pairs sharing their positions under the hashes as given: the first
+  // attempt cannot peel them, the remixed ones can
+  for (size_t i = 0; i + 1 < size && i < 20; i += 2) {
+    hashes[i + 1] = hashes[i] ^ (UINT64_C(1) << 40);
+  }
+  std::vector<uint64_t> sorted(hashes);
+  std::sort(sorted.begin(), sorted.end());
+
+  binary_fuse16_hashed_t filter(size);
+  if (!filter.populate(hashes)) { printf("failure to populate\n"); return false; }
+  std::unique_ptr<bool[]> answers(new bool[size]);
+  filter.contain_batch(hashes.data(), size, answers.get());
+  if (!std::all_of(answers.get(), answers.get() + size, [](bool b) { return b; })) {
+    printf("bug in contain_batch!\n");
+    return false;
+  }
+  if (filter.seed() == 0) {
+    printf("the first attempt should have failed\n");
+    return false;
+  }
+  for (size_t i = 0; i < size; i++) {
+    if (!filter.contain(hashes[i])) {
+      printf("bug!\n");
+      return false;
+    }
+  }
+
+  // sorted input skips the bucketing and gives the same filter
+  binary_fuse16_hashed_t fromSorted(size);
+  if (!fromSorted.populate(sorted)) { printf("failure to populate\n"); return false; }
+  if (fromSorted.seed() != filter.seed() ||
+      fromSorted.fingerprints() != filter.fingerprints()) {
+    printf("sorted and unsorted hashes give different filters\n");
+    return false;
+  }
+
+  size_t random_matches = 0;
+  size_t trials = 1000000;
+  for (size_t i = 0; i < trials; i++) {
+    random_matches += filter.contain(binary_fuse_rng_splitmix64(&rng));
+  }
+  double fpp = random_matches * 1.0 / trials;
+  printf(" fpp %3.5f (estimated) \n", fpp);
+  return fpp < 0.001;
+}
+
+bool testxor8(size_t size) {
+  printf("testing xor8 with size %zu\n", size);
+  xor_filter8_t filter(size);
+
+  // contiguous values with a few duplicates
+  std::vector<uint64_t> big_set(size);
+  std::iota(big_set.begin(), big_set.end(), 0);
+  for (size_t i = 0; i < size / 100; i++) {
+    big_set[size - 1 - i] = i;
+  }
+  if(!filter.populate(big_set)) { printf("failure to populate\n"); return false; }
+
+  for (size_t i = 0; i < big_set.size(); i++) {
+    if (!filter.contain(big_set[i])) {
+      printf("bug!\n");
+      return false;
+    }
+  }
+
+  size_t random_matches = 0;
+  size_t trials = 10000000;
+  for (size_t i = 0; i < trials; i++) {
+    uint64_t random_key = ((uint64_t)rand() << 32) + rand();
+    if (filter.contain(random_key)) {
+      if (random_key >= size) {
+        random_matches++;
+      }
+    }
+  }
+
+  double fpp = random_matches * 1.0 / trials;
+  printf(" fpp %3.5f (estimated) \n", fpp);
+  double bpe = filter.size_in_bytes() * 8.0 / size;
+  printf(" bits per entry %3.2f\n", bpe);
+  return fpp < 0.006;
+}
+
+// the Xor+ filter answers exactly like the xor filter it is built from
+bool testxorplus16(size_t size) {
+  printf("testing xor+16 with size %zu\n", size);
+  std::vector<uint64_t> big_set(size);
+  std::iota(big_set.begin(), big_set.end(), 0);
+
+  xor_filter16_t reference(size);
+  if(!reference.populate(big_set)) { printf("failure to populate\n"); return false; }
+  xor_plus_filter16_t filter(size);
+  if(!filter.populate(big_set)) { printf("failure to populate\n"); return false; }
+
+  for (size_t i = 0; i < size; i++) {
+    if (!filter.contain(big_set[i])) {
+      printf("bug!\n");
+      return false;
+    }
+  }
+  uint64_t rng = 7;
+  for (size_t i = 0; i < 1000000; i++) {
+    uint64_t key = binary_fuse_rng_splitmix64(&rng);
+    if (filter.contain(key) != reference.contain(key)) {
+      printf("xor+ and xor disagree on %llu\n", (unsigned long long)key);
+      return false;
+    }
+  }
+  double bpe = filter.size_in_bytes() * 8.0 / size;
+  printf(" bits per entry %3.2f (xor: %3.2f)\n", bpe,
+         reference.size_in_bytes() * 8.0 / size);
+
+  // the shared query API: a column probe with the same selection
+  std::vector<uint64_t> values(2 * size);
+  std::iota(values.begin(), values.end(), size / 2);
+  binary_fuse_column_t column;
+  column.values = values.data();
+  column.length = values.size();
+  std::vector<uint32_t> selection(values.size());
+  std::vector<uint32_t> expected(values.size());
+  size_t count = binary_fuse_probe(filter, column, selection.data(), 2);
+  if (count != binary_fuse_probe(reference, column, expected.data()) ||
+      !std::equal(selection.begin(), selection.begin() + count,
+                  expected.begin())) {
+    printf("probes disagree\n");
+    return false;
+  }
+  return bpe < reference.size_in_bytes() * 8.0 / size;
+}
+
 int main() {
   failure_rate_binary_fuse16();
   for(size_t size = 1000; size <= 1000000; size *= 300) {
@@ -301,6 +846,24 @@ int main() {
     printf("\n");
     if(!testbinaryfuse32_dup(size)) { abort(); }
     printf("\n");
+    if(!testbinaryfuse16_paged(size)) { abort(); }
+    printf("\n");
+    if(!testbinaryfuse8_multiprocess(size)) { abort(); }
+    printf("\n");
+    if(!testbinaryfuse8_instrumented(size)) { abort(); }
+    printf("\n");
+    if(!testbinaryfuse_planned(size, 0.001, 0, UINT32_MAX)) { abort(); }
+    printf("\n");
+    if(!testbinaryfuse_planned(size, 0, size * 2, size / 3)) { abort(); }
+    printf("\n");
+    if(!testbinaryfuse8_probe(size)) { abort(); }
+    printf("\n");
+    if(!testbinaryfuse16_hashes(size)) { abort(); }
+    printf("\n");
+    if(!testxor8(size)) { abort(); }
+    printf("\n");
+    if(!testxorplus16(size)) { abort(); }
+    printf("\n");
     printf("======\n");
   }
 }
\ No newline at end of file